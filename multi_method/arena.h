@@ -0,0 +1,137 @@
+#ifndef FILE_7F3A9C20_5D1B_4E68_B9A4_2C6E0D8F1B53_H
+#define FILE_7F3A9C20_5D1B_4E68_B9A4_2C6E0D8F1B53_H
+// Allocators of the Table states, a state is one block of StateBytes, cache
+// line aligned, freed by the Epoch.
+//
+// StateHeap takes them from malloc. StateArena, the default, rounds them up to
+// a power of two, carves them from chunks and keeps the freed ones for the
+// next state of that size, so once Reserve was called, or the tables reached
+// their size, a resize doesn't go to malloc, nor fault pages in.
+//
+// Usage:
+//   // At startup, before the latency sensitive threads.
+//   multi_method::StateArena::Reserve(1 << 20);
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+namespace multi_method {
+
+struct StateHeap {
+  static const size_t kAlign = 64;
+
+  static void *Allocate(size_t bytes) {
+    void *p = nullptr;
+    if (posix_memalign(&p, kAlign, bytes)) abort();
+    return p;
+  }
+
+  static void Free(void *p) {
+    free(p);
+  }
+};
+
+struct StateArena {
+  static const size_t kAlign = 64;
+  static const int kClasses = 48;
+  static const size_t kChunk = 1 << 20;
+
+  // Before each block, kAlign bytes so the block stays aligned.
+  struct Header {
+    Header *next;
+    int size_class;
+  };
+
+  std::mutex mutex_;
+  Header *free_[kClasses];
+  char *chunk_;
+  char *end_;
+  size_t reserved_;
+  size_t used_;
+
+  StateArena() : chunk_(nullptr), end_(nullptr), reserved_(0), used_(0) {
+    for (auto &f : free_) f = nullptr;
+  }
+
+  // Never destroyed, states may be freed after the static destructors.
+  static StateArena &Instance() {
+    static StateArena *arena = new StateArena;
+    return *arena;
+  }
+
+  static void *Allocate(size_t bytes) {
+    return Instance().Get(bytes);
+  }
+
+  static void Free(void *p) {
+    Instance().Put(p);
+  }
+
+  // Makes sure bytes more can be carved without malloc, the pages are
+  // touched now.
+  static void Reserve(size_t bytes) {
+    auto &arena = Instance();
+    std::lock_guard<std::mutex> lk(arena.mutex_);
+    if ((size_t)(arena.end_ - arena.chunk_) < bytes) arena.NewChunk(bytes);
+  }
+
+  // Bytes taken from malloc, and handed out to the states alive.
+  static size_t reserved() {
+    auto &arena = Instance();
+    std::lock_guard<std::mutex> lk(arena.mutex_);
+    return arena.reserved_;
+  }
+
+  static size_t used() {
+    auto &arena = Instance();
+    std::lock_guard<std::mutex> lk(arena.mutex_);
+    return arena.used_;
+  }
+
+ private:
+  static int size_class(size_t bytes) {
+    int c = 0;
+    while (((size_t)1 << c) < bytes + kAlign) ++c;
+    return c;
+  }
+
+  void NewChunk(size_t bytes) {
+    size_t size = bytes < kChunk ? kChunk : bytes;
+    void *p = nullptr;
+    if (posix_memalign(&p, kAlign, size)) abort();
+    memset(p, 0, size);
+    // The rest of the old chunk is lost, it's less than a block.
+    chunk_ = (char*)p;
+    end_ = chunk_ + size;
+    reserved_ += size;
+  }
+
+  void *Get(size_t bytes) {
+    int c = size_class(bytes);
+    size_t size = (size_t)1 << c;
+    std::lock_guard<std::mutex> lk(mutex_);
+    Header *h = free_[c];
+    if (h) {
+      free_[c] = h->next;
+    } else {
+      if ((size_t)(end_ - chunk_) < size) NewChunk(size);
+      h = (Header*)chunk_;
+      h->size_class = c;
+      chunk_ += size;
+    }
+    used_ += size;
+    return (char*)h + kAlign;
+  }
+
+  void Put(void *p) {
+    Header *h = (Header*)((char*)p - kAlign);
+    std::lock_guard<std::mutex> lk(mutex_);
+    h->next = free_[h->size_class];
+    free_[h->size_class] = h;
+    used_ -= (size_t)1 << h->size_class;
+  }
+};
+
+}  // namespace multi_method
+#endif // FILE_7F3A9C20_5D1B_4E68_B9A4_2C6E0D8F1B53_H
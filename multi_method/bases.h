@@ -4,9 +4,35 @@
 #include <cstdint>
 #include <cassert>
 #include <cxxabi.h>
+#include <algorithm>
+#include <vector>
+
+#include "multi_method/table.h"
 
 namespace multi_method {
 
+struct Subobject {
+  const std::type_info *type_;
+  ptrdiff_t offset_;
+};
+
+// Public and unambiguous base subobjects of a most derived type, itself
+// first, with their offsets from the whole object.
+struct Layout {
+  std::vector<Subobject> subobjects_;
+
+  // False if type is not a base, or an ambiguous one.
+  bool offset_of(const std::type_info *type, ptrdiff_t &offset) const {
+    for (auto &o : subobjects_) {
+      if (o.type_ == type) {
+        offset = o.offset_;
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
 struct Bases {
   const std::type_info * type_;
   const void * si_type_;
@@ -71,6 +97,15 @@ struct Bases {
     return o;
   }
 
+  bool has_virtual_bases() const {
+    for (int i = 0; i < size(); ++i) {
+      if (is_virtual_at(i) || Bases(base_at(i)).has_virtual_bases()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
   template <class F>
   bool find(const F &func) {
     for (int i = 0; i < size(); ++i) {
@@ -81,19 +116,100 @@ struct Bases {
     return false;
   }
 
+  // The type and its public and unambiguous bases, from the layout, or from
+  // the type_info alone while no object of a class with virtual bases was
+  // seen.
   template <class F>
   bool find_recursive(const F &func) const {
-    if (func(type_)) return true;
-    for (int i = 0; i < size(); ++i) {
-      if (!is_public_at(i)) continue;
-      auto b = base_at(i);
-      if (func(b)) return true;
-      bool r = Bases(b).find_recursive(func);
-      if (r) return true;
+    auto l = has_virtual_bases() ? cached_layout() : &layout(nullptr);
+    if (!l) {
+      for (auto t : unique_bases()) {
+        if (func(t)) return true;
+      }
+      return false;
+    }
+    for (auto &o : l->subobjects_) {
+      if (func(o.type_)) return true;
     }
     return false;
   }
 
+  // Null if the layout is not computed yet.
+  const Layout *cached_layout() const {
+    return layout_cache().Find(type_);
+  }
+
+  static Table<const std::type_info*, const Layout*> &layout_cache() {
+    static Table<const std::type_info*, const Layout*> cache;
+    return cache;
+  }
+
+  // Computed once per type, from the first whole object seen, since the
+  // virtual base offsets are only in the vtable, but fixed for a most
+  // derived type.
+  const Layout &layout(const void *whole) const {
+    auto &cache = layout_cache();
+    auto l = cache.Find(type_);
+    if (l) return *l;
+    auto n = new Layout;
+    std::vector<Subobject> all;
+    collect_subobjects(whole, 0, all);
+    for (auto &o : all) {
+      bool unique = true;
+      for (auto &p : all) {
+        if (p.type_ == o.type_ && p.offset_ != o.offset_) unique = false;
+      }
+      if (unique) n->subobjects_.push_back(o);
+    }
+    auto r = cache.Add(type_, n);
+    if (!r.second) delete n;
+    return *r.first;
+  }
+
+  // The types of the layout, without an object, so without their offsets: a
+  // virtual base is one subobject whatever the paths to it.
+  std::vector<const std::type_info*> unique_bases() const {
+    std::vector<std::pair<const std::type_info*, bool>> all;
+    collect_shape(false, all);
+    std::vector<const std::type_info*> r;
+    for (auto &o : all) {
+      int count = 0;
+      for (auto &p : all) count += p.first == o.first;
+      if (count == 1) r.push_back(o.first);
+    }
+    return r;
+  }
+
+  void collect_shape(
+      bool shared,
+      std::vector<std::pair<const std::type_info*, bool>> &out) const {
+    if (shared) {
+      for (auto &o : out) {
+        if (o.first == type_ && o.second) return;
+      }
+    }
+    out.push_back({type_, shared});
+    for (int i = 0, c = size(); i < c; ++i) {
+      if (!is_public_at(i)) continue;
+      Bases(base_at(i)).collect_shape(is_virtual_at(i), out);
+    }
+  }
+
+  // Shared virtual bases are visited once, repeated non virtual ones are all
+  // kept, with different offsets.
+  void collect_subobjects(const void *obj, ptrdiff_t offset,
+                          std::vector<Subobject> &out) const {
+    for (auto &o : out) {
+      if (o.type_ == type_ && o.offset_ == offset) return;
+    }
+    out.push_back({type_, offset});
+    for (int i = 0, c = size(); i < c; ++i) {
+      if (!is_public_at(i)) continue;
+      auto o = offset_at(i, obj);
+      Bases(base_at(i)).collect_subobjects((char*)obj + o, offset + o, out);
+    }
+  }
+
   bool contains(const void *obj,
                 const std::type_info *srctype,
                 const void *srcptr) const {
@@ -109,11 +225,27 @@ struct Bases {
     return false;
   }
 
+  // Without srctype, obj must be the whole object, and the cached layout is
+  // used, each base subobject is visited once.
   template <class Func>
   bool upcast_recursive_check(const Func &func,
-                             const void *obj,
-                             const std::type_info *srctype = nullptr,
+                              const void *obj,
+                              const std::type_info *srctype = nullptr,
                               const void *srcptr = nullptr) const {
+    if (!srctype) {
+      for (auto &o : layout(obj).subobjects_) {
+        if (func(o.type_, (const char*)obj + o.offset_)) return true;
+      }
+      return false;
+    }
+    return upcast_walk_check(func, obj, srctype, srcptr);
+  }
+
+  template <class Func>
+  bool upcast_walk_check(const Func &func,
+                         const void *obj,
+                         const std::type_info *srctype,
+                         const void *srcptr) const {
     assert(type_);
     if (srctype == type_ && obj == srcptr) {
       srctype = nullptr;
@@ -129,7 +261,7 @@ struct Bases {
       if (!is_public_at(i)) continue;
       auto b = base_at(i);
       auto o = offset_at(i, obj);
-      bool r = Bases(b).upcast_recursive_check(
+      bool r = Bases(b).upcast_walk_check(
           func, (char*)obj + o, srctype, srcptr);
       if (r) return true;
     }
@@ -0,0 +1,199 @@
+#ifndef FILE_B42EFBBA_AAA4_4961_857C_0EFD81ABA4DC_H
+#define FILE_B42EFBBA_AAA4_4961_857C_0EFD81ABA4DC_H
+// Epoch based reclamation.
+//
+// Readers enter a critical section with EpochGuard, which only stores the
+// global epoch in a per thread record. A writer, after unlinking a pointer,
+// retires it, it's freed once the global epoch went two steps further, which
+// can only happen when no reader may still hold it.
+//
+// Guards can be nested, only the outer one counts.
+//
+// On Linux, the store of a reader is not fenced, the writer issues a
+// membarrier instead before looking at the records, retiring is rare.
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace multi_method {
+
+struct Epoch {
+  struct Record {
+    // 0 when the thread is not in a critical section.
+    std::atomic<uint64_t> epoch_;
+    std::atomic<bool> used_;
+    int depth_;
+    Record *next_;
+  };
+
+  struct Retired {
+    uint64_t epoch_;
+    void *ptr_;
+    void (*free_)(void *);
+    size_t bytes_;
+  };
+
+  std::atomic<uint64_t> global_;
+  std::atomic<Record *> records_;
+  std::mutex mutex_;
+  std::vector<Retired> retired_;
+  size_t retired_bytes_;
+
+  // Whether Barrier does fence all the running threads.
+  bool asymmetric_;
+
+  Epoch()
+      : global_(1), records_(nullptr), retired_bytes_(0), asymmetric_(false) {
+    // Retiring doesn't allocate, unless that many wait at once.
+    retired_.reserve(256);
+#if defined(__linux__) && defined(__NR_membarrier)
+    asymmetric_ = syscall(
+        __NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+#endif
+  }
+
+  // Never destroyed, threads may exit after the static destructors.
+  static Epoch &Instance() {
+    static Epoch *epoch = new Epoch;
+    return *epoch;
+  }
+
+  inline Record *Enter() {
+    auto r = Local();
+    if (r->depth_++ == 0) {
+      r->epoch_.store(global_.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+      if (asymmetric_) {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+      } else {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+      }
+    }
+    return r;
+  }
+
+  inline void Exit(Record *r) {
+    if (--r->depth_ == 0) {
+      r->epoch_.store(0, std::memory_order_release);
+    }
+  }
+
+  // ptr must already be unreachable for new readers, bytes is only for the
+  // stats.
+  void Retire(void *ptr, void (*free)(void *), size_t bytes = 0) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    retired_.push_back({global_.load(), ptr, free, bytes});
+    retired_bytes_ += bytes;
+    ReclaimLocked();
+  }
+
+  void Reclaim() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    ReclaimLocked();
+  }
+
+  size_t retired() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return retired_.size();
+  }
+
+  size_t retired_bytes() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return retired_bytes_;
+  }
+
+ private:
+  struct Releaser {
+    Record *record_;
+
+    ~Releaser() {
+      record_->used_.store(false, std::memory_order_release);
+    }
+  };
+
+  inline Record *Local() {
+    static thread_local Record *record = nullptr;
+    if (record) return record;
+    record = Acquire();
+    static thread_local Releaser releaser{record};
+    (void)releaser;
+    return record;
+  }
+
+  Record *Acquire() {
+    for (auto r = records_.load(); r; r = r->next_) {
+      bool used = false;
+      if (!r->used_.load(std::memory_order_relaxed) &&
+          r->used_.compare_exchange_strong(used, true)) {
+        return r;
+      }
+    }
+    auto r = new Record;
+    r->epoch_.store(0, std::memory_order_relaxed);
+    r->used_.store(true, std::memory_order_relaxed);
+    r->depth_ = 0;
+    r->next_ = records_.load();
+    while (!records_.compare_exchange_weak(r->next_, r)) {}
+    return r;
+  }
+
+  void Barrier() {
+#if defined(__linux__) && defined(__NR_membarrier)
+    if (asymmetric_) {
+      syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+      return;
+    }
+#endif
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  bool TryAdvance() {
+    Barrier();
+    auto g = global_.load();
+    for (auto r = records_.load(); r; r = r->next_) {
+      auto e = r->epoch_.load();
+      if (e != 0 && e != g) return false;
+    }
+    return global_.compare_exchange_strong(g, g + 1);
+  }
+
+  void ReclaimLocked() {
+    if (retired_.empty()) return;
+    if (TryAdvance()) TryAdvance();
+    auto g = global_.load();
+    size_t kept = 0;
+    for (auto &r : retired_) {
+      if (r.epoch_ + 2 <= g) {
+        r.free_(r.ptr_);
+        retired_bytes_ -= r.bytes_;
+      } else {
+        retired_[kept++] = r;
+      }
+    }
+    retired_.resize(kept);
+  }
+};
+
+struct EpochGuard {
+  Epoch::Record *record_;
+
+  EpochGuard() : record_(Epoch::Instance().Enter()) {}
+
+  ~EpochGuard() {
+    Epoch::Instance().Exit(record_);
+  }
+
+  EpochGuard(const EpochGuard &) = delete;
+  EpochGuard &operator=(const EpochGuard &) = delete;
+};
+
+}  // namespace multi_method
+#endif // FILE_B42EFBBA_AAA4_4961_857C_0EFD81ABA4DC_H
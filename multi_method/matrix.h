@@ -0,0 +1,424 @@
+#ifndef FILE_F9DCBEF2_E584_4637_A360_4ACD74245CAE_H
+#define FILE_F9DCBEF2_E584_4637_A360_4ACD74245CAE_H
+// Compressed dispatch matrix, an alternate backend to the resolved_ table.
+//
+// For each argument position, the classes are grouped by the set of overload
+// types they derive from there, classes in the same group always get the same
+// overload. The resolutions are stored in an N dimension array indexed by the
+// groups, so its size depends on the number of distinct behaviours, not on
+// the number of type tuples seen.
+//
+// A lookup is: class id from the state's own map of the classes (one pointer
+// keyed probe per argument, first slot mostly), group, cell, and the offset of
+// the selected base, which is kept per class since it's fixed for a most
+// derived type. Old states are retired through the Epoch.
+//
+// Classes are discovered on the first call with them, or registered with
+// Register. Offsets can only be read from a real object when there're virtual
+// bases, so they're filled on the first call with each class.
+//
+// Usage:
+//   multi_method::DispatchMatrix<2, multi_method::void_func> matrix;
+//   std::array<void*, 2> ptrs;
+//   auto fp = matrix.Find(mm_mat_add, ptrs, a, b);
+
+#include "multi_method/epoch.h"
+#include "multi_method/partial.h"
+#include "multi_method/registry.h"
+
+#include <map>
+#include <memory>
+
+namespace multi_method {
+
+template <int N, class Func>
+struct DispatchMatrix {
+  typedef TypePartialArray<N> partial;
+
+  static constexpr ptrdiff_t kUnplaced = PTRDIFF_MIN;
+
+  struct Cell {
+    Func func;
+    std::array<int, N> target;
+    // No func since several overloads apply, none more specific.
+    bool ambiguous;
+  };
+
+  struct Dim {
+    std::vector<const std::type_info*> targets;
+    // By class id, -1 if the class is not covered.
+    std::vector<int> group;
+    int groups;
+    size_t stride;
+    // Where the offsets of this position start in a class row.
+    size_t base;
+  };
+
+  // Class ids of the ClassRegistry, without going through it on a hit.
+  struct ClassSlot {
+    const std::type_info *key;
+    int id;
+  };
+
+  struct State {
+    Dim dims[N];
+    std::vector<Cell> cells;
+    int classes;
+    size_t row_size;
+    // By class id, offsets of every target of every position.
+    std::unique_ptr<std::atomic<ptrdiff_t*>[]> rows;
+    // Open addressing by type_info, a null key ends a probe.
+    std::vector<ClassSlot> ids;
+
+    inline int id(const std::type_info *type) const {
+      size_t mask = ids.size() - 1;
+      for (size_t i = mix_hash((uintptr_t)type) & mask;; i = (i + 1) & mask) {
+        if (ids[i].key == type) return ids[i].id;
+        if (!ids[i].key) return -1;
+      }
+    }
+
+    ~State() {
+      if (!rows) return;
+      for (int c = 0; c < classes; ++c) {
+        delete[] rows[c].load(std::memory_order_relaxed);
+      }
+    }
+  };
+
+  std::atomic<State *> state_;
+  std::mutex mutex_;
+  std::vector<const std::type_info*> classes_;
+
+  DispatchMatrix() : state_(nullptr) {}
+
+  ~DispatchMatrix() {
+    delete state_.load();
+  }
+
+  DispatchMatrix(const DispatchMatrix &) = delete;
+  DispatchMatrix &operator=(const DispatchMatrix &) = delete;
+
+  // Fast path, returns false when the tuple is not in the matrix yet.
+  inline bool Find(const partial &real, std::array<void*, N> &ptrs,
+                   Func &func) {
+    // Unsealed methods don't pay for the guard.
+    if (!state_.load(std::memory_order_relaxed)) return false;
+    EpochGuard guard;
+    auto s = state_.load(std::memory_order_acquire);
+    if (!s) return false;
+    size_t at = 0;
+    const ptrdiff_t *rows[N];
+    for (int i = 0; i < N; ++i) {
+      int id = s->id(real[i].type_);
+      if (id < 0) return false;
+      int g = s->dims[i].group[id];
+      if (g < 0) return false;
+      at += g * s->dims[i].stride;
+      rows[i] = s->rows[id].load(std::memory_order_acquire);
+      if (!rows[i]) return false;
+    }
+    const Cell &c = s->cells[at];
+    if (!c.func) return false;
+    ptrdiff_t offsets[N];
+    for (int i = 0; i < N; ++i) {
+      offsets[i] = rows[i][s->dims[i].base + c.target[i]];
+      if (offsets[i] == kUnplaced) return false;
+    }
+    for (int i = 0; i < N; ++i) {
+      ptrs[i] = (char*)ptrs[i] + offsets[i];
+    }
+    func = c.func;
+    return true;
+  }
+
+  // Finds in the matrix, adds the real classes on a miss, and leaves to the
+  // MultiMethod what can't be resolved uniquely.
+  template <class MM>
+  Func Find(MM &mm, const partial &real, std::array<void*, N> &ptrs) {
+    Func func;
+    if (Find(real, ptrs, func)) return func;
+    Discover(mm.table_, real, ptrs);
+    if (Find(real, ptrs, func)) return func;
+    return mm.Find(real, ptrs);
+  }
+
+  template <class MM, class ...U>
+  inline Func Find(MM &mm, std::array<void*, N> &func_ptrs, const U & ...v) {
+    partial real;
+    mm.template init_find<0>(real, func_ptrs, v...);
+    return Find(mm, real, func_ptrs);
+  }
+
+  // Adds classes without objects, their offsets are read on the first call.
+  template <class Overloads>
+  void Register(const Overloads &overloads,
+                const std::vector<const std::type_info*> &types) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    bool changed = false;
+    for (auto t : types) {
+      changed |= AddClass(t);
+    }
+    if (changed || !state_.load(std::memory_order_relaxed)) {
+      Build(overloads);
+    }
+    auto s = state_.load(std::memory_order_relaxed);
+    for (auto t : types) {
+      if (!Bases(t).has_virtual_bases()) FillRow(s, t, nullptr);
+    }
+  }
+
+  // Resolves the cells again, after the overloads changed. Rows are filled
+  // again on the next call if the targets changed.
+  template <class Overloads>
+  void Rebuild(const Overloads &overloads) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    if (state_.load(std::memory_order_relaxed)) Build(overloads);
+  }
+
+  // Fills the offsets of covered classes met for the first time, without
+  // adding classes, returns whether anything was filled.
+  bool Fill(const partial &real, const std::array<void*, N> &objs) {
+    if (!state_.load(std::memory_order_relaxed)) return false;
+    EpochGuard guard;
+    auto s = state_.load(std::memory_order_acquire);
+    if (!s) return false;
+    bool filled = false;
+    for (int i = 0; i < N; ++i) {
+      filled |= FillRow(s, real[i].type_, objs[i]);
+    }
+    return filled;
+  }
+
+  // Calls func(tuple, ambiguous) with one tuple of classes for each cell
+  // without an overload.
+  template <class F>
+  void foreach_unresolved(const F &func) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto s = state_.load(std::memory_order_acquire);
+    if (!s) return;
+    for (size_t at = 0; at < s->cells.size(); ++at) {
+      auto &c = s->cells[at];
+      if (c.func) continue;
+      partial p;
+      for (int i = 0; i < N; ++i) {
+        int g = at / s->dims[i].stride % s->dims[i].groups;
+        for (auto t : classes_) {
+          auto id = ClassRegistry::Instance().Find(t)->id_;
+          if (s->dims[i].group[id] == g) {
+            p[i] = t;
+            break;
+          }
+        }
+      }
+      func(p, c.ambiguous);
+    }
+  }
+
+  template <class Overloads>
+  void Discover(const Overloads &overloads, const partial &real,
+                const std::array<void*, N> &objs) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    bool changed = false;
+    for (int i = 0; i < N; ++i) {
+      changed |= AddClass(real[i].type_);
+    }
+    if (changed || !state_.load(std::memory_order_relaxed)) {
+      Build(overloads);
+    }
+    auto s = state_.load(std::memory_order_relaxed);
+    for (int i = 0; i < N; ++i) {
+      FillRow(s, real[i].type_, objs[i]);
+    }
+  }
+
+  // Number of cells, for the curious.
+  size_t size() const {
+    auto s = state_.load(std::memory_order_acquire);
+    return s ? s->cells.size() : 0;
+  }
+
+ private:
+  bool AddClass(const std::type_info *type) {
+    ClassRegistry::Instance().Register(type);
+    if (std::find(classes_.begin(), classes_.end(), type) != classes_.end()) {
+      return false;
+    }
+    classes_.push_back(type);
+    return true;
+  }
+
+  template <class Overloads>
+  void Build(const Overloads &overloads) {
+    std::vector<std::pair<partial, Func>> funcs;
+    overloads.foreach([&](const partial &p, const Func &f) {
+        funcs.push_back({p, f});
+      });
+    auto &registry = ClassRegistry::Instance();
+    std::unique_ptr<State> s(new State);
+    s->classes = registry.size();
+    s->row_size = 0;
+    // Applicability is by the public and unambiguous bases, like Best, so
+    // every target of a cell has a subobject in the classes of its groups.
+    std::vector<std::vector<const std::type_info*>> bases;
+    for (auto c : classes_) {
+      Bases b(c);
+      auto layout = b.has_virtual_bases() ? b.cached_layout() :
+          &b.layout(nullptr);
+      bases.push_back({});
+      if (!layout) {
+        bases.back() = b.unique_bases();
+        continue;
+      }
+      for (auto &o : layout->subobjects_) bases.back().push_back(o.type_);
+    }
+    // applicable[i][group] is the set of targets of the group at i.
+    std::vector<std::vector<char>> applicable[N];
+    size_t cells = 1;
+    for (int i = 0; i < N; ++i) {
+      auto &d = s->dims[i];
+      for (auto &f : funcs) {
+        auto t = f.first[i].type_;
+        if (std::find(d.targets.begin(), d.targets.end(), t) ==
+            d.targets.end()) {
+          d.targets.push_back(t);
+        }
+      }
+      d.group.assign(s->classes, -1);
+      std::map<std::vector<char>, int> groups;
+      for (size_t j = 0; j < classes_.size(); ++j) {
+        auto c = classes_[j];
+        std::vector<char> set(d.targets.size());
+        for (size_t k = 0; k < d.targets.size(); ++k) {
+          set[k] = std::find(bases[j].begin(), bases[j].end(),
+                             d.targets[k]) != bases[j].end();
+        }
+        auto it = groups.insert({set, (int)groups.size()}).first;
+        if (it->second == (int)applicable[i].size()) {
+          applicable[i].push_back(set);
+        }
+        d.group[registry.Find(c)->id_] = it->second;
+      }
+      d.groups = groups.size();
+      d.base = s->row_size;
+      s->row_size += d.targets.size();
+    }
+    for (int i = N - 1; i >= 0; --i) {
+      s->dims[i].stride = cells;
+      cells *= s->dims[i].groups;
+    }
+    s->cells.resize(cells);
+    for (size_t at = 0; at < cells; ++at) {
+      std::array<int, N> g;
+      for (int i = 0; i < N; ++i) {
+        g[i] = at / s->dims[i].stride % s->dims[i].groups;
+      }
+      s->cells[at] = Resolve(*s, funcs, applicable, g);
+    }
+    s->rows.reset(new std::atomic<ptrdiff_t*>[s->classes]);
+    for (int c = 0; c < s->classes; ++c) {
+      s->rows[c].store(nullptr, std::memory_order_relaxed);
+    }
+    size_t slots = 4;
+    while (slots < classes_.size() * 2) slots *= 2;
+    s->ids.assign(slots, ClassSlot{nullptr, -1});
+    for (auto c : classes_) {
+      size_t i = mix_hash((uintptr_t)c) & (slots - 1);
+      while (s->ids[i].key) i = (i + 1) & (slots - 1);
+      s->ids[i] = {c, registry.Find(c)->id_};
+    }
+    // Rows of the old state are still valid if the targets didn't change.
+    auto old = state_.load(std::memory_order_relaxed);
+    if (old && SameTargets(*old, *s)) {
+      for (int c = 0; c < old->classes; ++c) {
+        auto row = old->rows[c].load(std::memory_order_acquire);
+        if (!row) continue;
+        auto copy = new ptrdiff_t[s->row_size];
+        std::copy(row, row + s->row_size, copy);
+        s->rows[c].store(copy, std::memory_order_relaxed);
+      }
+    }
+    state_.store(s.release(), std::memory_order_release);
+    if (old) {
+      Epoch::Instance().Retire(
+          old, [](void *p) { delete (State*)p; },
+          sizeof(State) + old->cells.size() * sizeof(Cell) +
+          old->classes * (1 + old->row_size) * sizeof(ptrdiff_t));
+    }
+  }
+
+  static bool SameTargets(const State &a, const State &b) {
+    for (int i = 0; i < N; ++i) {
+      if (a.dims[i].targets != b.dims[i].targets) return false;
+    }
+    return true;
+  }
+
+  // Most specific applicable overload, a null func if none or ambiguous.
+  static Cell Resolve(const State &s,
+                      const std::vector<std::pair<partial, Func>> &funcs,
+                      const std::vector<std::vector<char>> *applicable,
+                      const std::array<int, N> &g) {
+    auto is_applicable = [&](const partial &p) {
+      for (int i = 0; i < N; ++i) {
+        if (!applicable[i][g[i]][TargetIndex(s.dims[i], p[i].type_)]) {
+          return false;
+        }
+      }
+      return true;
+    };
+    const std::pair<partial, Func> *best = nullptr;
+    for (auto &f : funcs) {
+      if (!is_applicable(f.first)) continue;
+      if (!best || f.first > best->first) best = &f;
+    }
+    Cell c = Cell();
+    if (!best) return c;
+    for (auto &f : funcs) {
+      if (is_applicable(f.first) && !(best->first >= f.first)) {
+        c.ambiguous = true;
+        return c;
+      }
+    }
+    c.func = best->second;
+    for (int i = 0; i < N; ++i) {
+      c.target[i] = TargetIndex(s.dims[i], best->first[i].type_);
+    }
+    return c;
+  }
+
+  static int TargetIndex(const Dim &d, const std::type_info *t) {
+    return std::find(d.targets.begin(), d.targets.end(), t) -
+        d.targets.begin();
+  }
+
+  // whole can be null when the class has no virtual base. Targets without a
+  // subobject in the class are kUnplaced, and a cell with one is a miss.
+  static bool FillRow(State *s, const std::type_info *type,
+                      const void *whole) {
+    auto info = ClassRegistry::Instance().Find(type);
+    if (!info || info->id_ >= s->classes) return false;
+    auto &slot = s->rows[info->id_];
+    if (slot.load(std::memory_order_acquire)) return false;
+    auto row = new ptrdiff_t[s->row_size];
+    auto &layout = Bases(type).layout(whole);
+    for (int i = 0; i < N; ++i) {
+      auto &d = s->dims[i];
+      for (size_t k = 0; k < d.targets.size(); ++k) {
+        if (!layout.offset_of(d.targets[k], row[d.base + k])) {
+          row[d.base + k] = kUnplaced;
+        }
+      }
+    }
+    ptrdiff_t *expected = nullptr;
+    if (!slot.compare_exchange_strong(expected, row,
+                                      std::memory_order_acq_rel)) {
+      delete[] row;
+      return false;
+    }
+    return true;
+  }
+};
+
+}  // namespace multi_method
+#endif // FILE_F9DCBEF2_E584_4637_A360_4ACD74245CAE_H
@@ -1,6 +1,20 @@
 #ifndef FILE_0D5D7553_9F5D_484A_B873_F599D81EFA9D_H
 #define FILE_0D5D7553_9F5D_484A_B873_F599D81EFA9D_H
-// Rule: Any time we find a resolution, it's fixed.
+// Rule: Any time we find a resolution, it's fixed, until an Add of an
+// overload which applies to it. Add resolves these tuples again, and publishes
+// a copy of resolved_ with them, readers keep using the old copy meanwhile.
+// The other entries stay, and the caches in front are dropped by the
+// generation.
+//
+// Resolution is lazy, unless Seal is given the classes up front, then they're
+// all resolved in a DispatchMatrix, ambiguities are reported by Seal instead
+// of aborting in Find, and the calls with these classes don't touch resolved_.
+//
+// A tuple without a unique most specific overload, ambiguous or without any,
+// is cached in resolved_ like a success, and goes through the error policy on
+// every call: abort (the default), a fallback function called with the whole
+// objects, a DispatchError thrown, or a null function returned, Lookup tells
+// which failure it was.
 //
 // Consideration: We can disambuiguous according declartions, not just real
 // types, but it costs.
@@ -45,103 +59,597 @@
 //  // but banded is not specialize before, so
 //  mat_add((Matrix&)b, (Matrix&)d); // we'll call mat_add_mm here
 
+#include "multi_method/matrix.h"
 #include "multi_method/partial.h"
+#include "multi_method/single.h"
+#include "multi_method/thread_cache.h"
+
+#include <stdexcept>
 
 namespace multi_method {
 
 typedef void (*void_func)(void);
 
-template <int N>
+// kUnresolved is zero, so it's what resolved_ returns for a missing tuple.
+enum class Resolution : uint8_t { kUnresolved, kResolved, kAmbiguous, kNoMatch };
+
+enum class ErrorPolicy { kAbort, kFallback, kThrow, kErrorCode };
+
+struct DispatchError : std::runtime_error {
+  Resolution status_;
+
+  DispatchError(Resolution status, const std::string &types)
+      : std::runtime_error((status == Resolution::kAmbiguous ?
+                            "ambiguous multi method call " :
+                            "no applicable multi method for ") + types),
+        status_(status) {}
+};
+
+// The smallest power of two at least n.
+constexpr size_t pow2_ceil(size_t n, size_t p = 1) {
+  return p >= n ? p : pow2_ceil(n, p * 2);
+}
+
+// Whether the first K types are final.
+template <int K, class ...U>
+struct leading_final : std::true_type {};
+
+template <int K, class H, class ...U>
+struct leading_final<K, H, U...>
+    : std::integral_constant<bool, (K <= 0) ||
+                             (__is_final(H) &&
+                              leading_final<K - 1, U...>::value)> {};
+
+template <int N, class Func = void_func>
 struct MultiMethod {
+  static const int arity = N;
+  typedef Func func_type;
   typedef TypePartialArray<N> partial;
   typedef std::array<ptrdiff_t, N> offsets_type;
 
-  struct ResolvedMethod {
+  // An entry of resolved_, only what a call needs, the overload itself is not
+  // kept, Best finds it again for the few users. Aligned to a power of two,
+  // 32 bytes for N = 2, so an entry is never split between cache lines.
+  struct alignas(pow2_ceil(sizeof(Func) + sizeof(int32_t) * N +
+                           sizeof(Resolution))) ResolvedMethod {
+    Func func;
+    std::array<int32_t, N> offsets;
+    Resolution status;
+  };
+
+  // What Best found, with the overload.
+  struct Chosen {
     partial pos;
-    void_func func;
-    offsets_type offsets;
+    ResolvedMethod method;
+  };
+
+  // Tuples of the sealed classes without a unique overload.
+  struct SealReport {
+    std::vector<partial> ambiguous;
+    std::vector<partial> missing;
+
+    bool ok() const {
+      return ambiguous.empty() && missing.empty();
+    }
   };
 
-  Table<partial, void_func> table_;
+  typedef ThreadCache<N, Func> thread_cache_type;
+
+  Table<partial, Func> table_;
   Table<partial, ResolvedMethod> resolved_;
+  DispatchMatrix<N, Func> sealed_;
+  // Tags of this instance in the thread caches.
+  const uint64_t id_;
+  std::atomic<uint64_t> generation_;
+  // Only used when N is 1, in front of everything else.
+  SingleDispatchTable<Func> single_;
+  bool thread_cache_;
+  // Calls by real tuple while profile_ is set, see profile.h.
+  std::atomic<bool> profile_;
+  Table<partial, std::atomic<uint64_t>*> profile_counts_;
+  // Held by Add, and by Resolve to store a resolution, which is only done if
+  // no Add happened since it started.
+  std::mutex resolve_mutex_;
+  // Single flight of the resolutions, a tuple is resolved by one thread at a
+  // time, the others wait on its stripe and then find it in resolved_.
+  static const size_t kResolveStripes = 16;
+  std::mutex resolve_stripes_[kResolveStripes];
+  // Bindings of each FindStatic of final types, by instance id.
+  static const size_t kBoundSlots = 4;
+  ErrorPolicy error_policy_;
+  Func fallback_;
+#ifdef MULTI_METHOD_STATS
+  Sharded<MultiMethodShard> stats_;
+#endif
 
-  template <class Func>
-  int Add(const partial &p, Func func) {
-    void_func vf = reinterpret_cast<void_func>(func);
-    table_.Add(p, vf);
-    return 1;
+  MultiMethod()
+      : id_(NextInstanceId()), generation_(1), single_(1),
+        thread_cache_(false), profile_(false),
+        error_policy_(ErrorPolicy::kAbort), fallback_() {}
+
+  // Adds a per thread cache in front of resolved_, so the threads don't share
+  // any cache line on a hit. Set it before the calls.
+  void EnableThreadCache(bool enable = true) {
+    thread_cache_ = enable;
+  }
+
+  // Counts the calls of each real tuple, for Profile.
+  void EnableProfile(bool enable = true) {
+    profile_.store(enable, std::memory_order_relaxed);
+  }
+
+  void Count(const partial &real) {
+    auto c = profile_counts_.Find(real);
+    if (!c) {
+      auto n = new std::atomic<uint64_t>(0);
+      c = profile_counts_.Add(real, n).first;
+      if (c != n) delete n;
+    }
+    c->fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // The counted tuples, most called first.
+  std::vector<std::pair<partial, uint64_t>> Profile() const {
+    std::vector<std::pair<partial, uint64_t>> counts;
+    profile_counts_.foreach([&](const partial &real,
+                                std::atomic<uint64_t> *c) {
+        counts.push_back({real, c->load(std::memory_order_relaxed)});
+      });
+    std::stable_sort(counts.begin(), counts.end(),
+                     [](const std::pair<partial, uint64_t> &a,
+                        const std::pair<partial, uint64_t> &b) {
+                       return a.second > b.second;
+                     });
+    return counts;
+  }
+
+  // What Find does for a tuple without a unique overload. Set it before the
+  // calls, the caches keep what it gave.
+  void SetErrorPolicy(ErrorPolicy policy) {
+    error_policy_ = policy;
+  }
+
+  // The fallback is called with the whole objects.
+  template <class F>
+  void SetErrorPolicy(ErrorPolicy policy, F fallback) {
+    error_policy_ = policy;
+    fallback_ = to_func(fallback);
+  }
+
+  // Drops the entries of this instance from all the thread caches.
+  void Invalidate() {
+    auto generation = generation_.fetch_add(1, std::memory_order_release) + 1;
+    if (N == 1) single_.Clear(generation);
+  }
+
+  static Func to_func(const Func &func) {
+    return func;
   }
 
-  template <class ...U, class Func>
-  int Add(Func func) {
-    void_func vf = reinterpret_cast<void_func>(func);
-    table_.Add({TypePartial{&typeid(U)}...}, vf);
+  template <class F>
+  static Func to_func(F func) {
+    return reinterpret_cast<Func>(func);
+  }
+
+  template <class F>
+  int Add(const partial &p, F func) {
+    std::lock_guard<std::mutex> lk(resolve_mutex_);
+    table_.Add(p, to_func(func));
+    Reresolve(p);
+    sealed_.Rebuild(table_);
+    Invalidate();
     return 1;
   }
 
-  void_func Find(const partial &real,
-                 const std::array<void*, N> &objs,
-                 std::array<void*, N> &func_ptrs) {
+  template <class ...U, class F>
+  int Add(F func) {
+    return Add(partial{TypePartial{&typeid(U)}...}, func);
+  }
+
+  ResolvedMethod Lookup(const partial &real,
+                        const std::array<void*, N> &objs) {
     auto m = resolved_.Find(real);
-    if (m.func) {
+    if (m.status == Resolution::kUnresolved) {
+      auto &stripe = resolve_stripes_[
+          mix_hash(TableHash<partial>()(real)) % kResolveStripes];
+      std::lock_guard<std::mutex> lk(stripe);
+      m = resolved_.Find(real);
+      if (m.status == Resolution::kUnresolved) {
+        MULTI_METHOD_STAT(auto start = std::chrono::steady_clock::now());
+        m = Resolve(real, objs);
+        MULTI_METHOD_STAT(stats_.Local().Resolved(start));
+      } else {
+        MULTI_METHOD_STAT(stats_.Local().resolve_waits_.Add());
+      }
+    } else {
+      MULTI_METHOD_STAT(stats_.Local().resolved_hits_.Add());
+    }
+    if (m.status != Resolution::kResolved) return Failed(m, real);
+    return m;
+  }
+
+  ResolvedMethod Failed(const ResolvedMethod &m, const partial &real) const {
+    auto r = m;
+    switch (error_policy_) {
+      case ErrorPolicy::kFallback:
+        r.func = fallback_;
+        return r;
+      case ErrorPolicy::kThrow:
+        throw DispatchError(m.status, to_str(real));
+      case ErrorPolicy::kErrorCode:
+        return r;
+      default:
+        abort();
+    }
+  }
+
+  Func Find(const partial &real,
+            const std::array<void*, N> &objs,
+            std::array<void*, N> &func_ptrs) {
+    func_ptrs = objs;
+    return Find(real, func_ptrs);
+  }
+
+  // Same as above, but adjusts the whole object pointers in place.
+  Func Find(const partial &real, std::array<void*, N> &ptrs) {
+    Func func;
+    if (profile_.load(std::memory_order_relaxed)) Count(real);
+    if (N == 1) {
+      if (single_.Find(real[0].type_, ptrs[0], func)) {
+        MULTI_METHOD_STAT(stats_.Local().single_hits_.Add());
+        return func;
+      }
+      return FindSingle(real, ptrs);
+    }
+    return FindMulti(real, ptrs);
+  }
+
+  Func FindSingle(const partial &real, std::array<void*, N> &ptrs) {
+    auto generation = generation_.load(std::memory_order_acquire);
+    auto whole = ptrs[0];
+    auto func = FindMulti(real, ptrs);
+    if (func) {
+      single_.Insert(real[0].type_, func, (char*)ptrs[0] - (char*)whole,
+                     generation);
+    }
+    return func;
+  }
+
+  Func FindMulti(const partial &real, std::array<void*, N> &ptrs) {
+    Func func;
+    if (sealed_.Find(real, ptrs, func) ||
+        (sealed_.Fill(real, ptrs) && sealed_.Find(real, ptrs, func))) {
+      MULTI_METHOD_STAT(stats_.Local().sealed_hits_.Add());
+      return func;
+    }
+    if (thread_cache_) return FindThreadCache(real, ptrs);
+    auto m = Lookup(real, ptrs);
+    for (int i = 0; i < N; ++i) {
+      ptrs[i] = (char*)ptrs[i] + m.offsets[i];
+    }
+    return m.func;
+  }
+
+  Func FindThreadCache(const partial &real, std::array<void*, N> &ptrs) {
+    auto generation = generation_.load(std::memory_order_acquire);
+    auto e = thread_cache_type::Find(id_, generation, real);
+    if (e) {
+      MULTI_METHOD_STAT(stats_.Local().thread_cache_hits_.Add());
+      for (int i = 0; i < N; ++i) {
+        ptrs[i] = (char*)ptrs[i] + e->offsets[i];
+      }
+      return e->func;
+    }
+    auto m = Lookup(real, ptrs);
+    thread_cache_type::Store(id_, generation, real, m.func, m.offsets);
+    for (int i = 0; i < N; ++i) {
+      ptrs[i] = (char*)ptrs[i] + m.offsets[i];
+    }
+    return m.func;
+  }
+
+  // Best, stored in resolved_.
+  ResolvedMethod Resolve(const partial &real,
+                         const std::array<void*, N> &objs) {
+    while (1) {
+      auto generation = generation_.load(std::memory_order_acquire);
+      auto m = Best(real, objs).method;
+      std::lock_guard<std::mutex> lk(resolve_mutex_);
+      if (generation_.load(std::memory_order_relaxed) == generation) {
+        return resolved_.Add(real, m).first;
+      }
+    }
+  }
+
+  // Resolves again the tuples p applies to, only them can change.
+  void Reresolve(const partial &p) {
+    Table<partial, ResolvedMethod> changed;
+    resolved_.foreach([&](const partial &real, const ResolvedMethod &) {
+        // Layouts of these types are cached, so no object is needed.
+        if (real >= p) changed.Add(real, Best(real, {}).method);
+      });
+    if (!changed.size()) return;
+    resolved_.Rebuild([&](const partial &real, const ResolvedMethod &m) {
+        auto c = changed.Find(real);
+        return c.status == Resolution::kUnresolved ? m : c;
+      });
+  }
+
+  // The most specific overload: a tournament over table_, then a check that
+  // the winner dominates every applicable one. Subtype tests are bit tests of
+  // the ClassRegistry, so a miss costs about overloads * N of them, whatever
+  // the depth of the hierarchies, and nothing is allocated.
+  Chosen Best(const partial &real,
+              const std::array<void*, N> &objs) {
+    auto &registry = ClassRegistry::Instance();
+    const ClassInfo *infos[N];
+    const Layout *layouts[N];
+    for (int i = 0; i < N; ++i) {
+      infos[i] = registry.Register(real[i].type_);
+      layouts[i] = &Bases(real[i].type_).layout(objs[i]);
+    }
+    auto applicable = [&](const partial &p, offsets_type &offsets) {
       for (int i = 0; i < N; ++i) {
-        func_ptrs[i] = (char*)objs[i] + m.offsets[i];
+        if (!infos[i]->derives_from(*registry.Register(p[i].type_)) ||
+            !layouts[i]->offset_of(p[i].type_, offsets[i])) {
+          return false;
+        }
       }
-      return m.func;
-    }
-    std::vector<ResolvedMethod> funcs;
-    upcast_recursive_check<N>(
-        [&](const partial &b, const std::array<void*, N> &ptrs) {
-          auto func = table_.Find(b);
-          if (!func) return false;
-          auto it = std::find_if(funcs.begin(), funcs.end(),
-                                 [&](const ResolvedMethod &m) {
-                                   return m.pos >= b;
-                                 });
-          if (it != funcs.end()) return false;
-          it = std::remove_if(funcs.begin(), funcs.end(),
-                              [&](const ResolvedMethod &m) {
-                                return m.pos <= b;
-                              });
-          funcs.resize(it - funcs.begin());
-          std::array<ptrdiff_t, N> offsets;
+      return true;
+    };
+    Chosen best = Chosen();
+    table_.foreach([&](const partial &p, const Func &func) {
+        offsets_type offsets;
+        if (!applicable(p, offsets)) return;
+        if (!best.method.func || p > best.pos) {
+          best.pos = p;
+          best.method.func = func;
+          best.method.status = Resolution::kResolved;
           for (int i = 0; i < N; ++i) {
-            offsets[i] = (char*)ptrs[i] - (char*)objs[i];
+            // Base subobjects are within the object.
+            assert(offsets[i] == (int32_t)offsets[i]);
+            best.method.offsets[i] = offsets[i];
           }
-          funcs.push_back({b, func, offsets});
-          return false;
-        },
-        real, objs);
-    if (funcs.size() == 1) {
-      auto &m = funcs.front();
-      resolved_.Add(real, m);
-      return Find(real, objs, func_ptrs);
+        }
+      });
+    bool unique = !!best.method.func;
+    table_.foreach_check([&](const partial &p, const Func &) {
+        offsets_type offsets;
+        if (applicable(p, offsets) && !(best.pos >= p)) unique = false;
+        return unique;
+      });
+    if (!unique) {
+      auto status = best.method.func ?
+          Resolution::kAmbiguous : Resolution::kNoMatch;
+      best = Chosen();
+      best.method.status = status;
     }
-    abort();
-    return nullptr;
+    return best;
+  }
+
+  // Snapshot of the counters, see stats.h.
+  MultiMethodStats Stats() const {
+    MultiMethodStats s;
+#ifdef MULTI_METHOD_STATS
+    s.enabled = true;
+    stats_.foreach([&](const MultiMethodShard &shard) {
+        s.single_hits += shard.single_hits_.get();
+        s.sealed_hits += shard.sealed_hits_.get();
+        s.thread_cache_hits += shard.thread_cache_hits_.get();
+        s.resolved_hits += shard.resolved_hits_.get();
+        s.resolutions += shard.resolutions_.get();
+        s.resolve_waits += shard.resolve_waits_.get();
+        for (int i = 0; i < MultiMethodStats::kTimeBuckets; ++i) {
+          s.resolve_ns[i] += shard.resolve_ns_[i].get();
+        }
+      });
+#endif
+    s.overloads = table_.Stats();
+    s.resolved = resolved_.Stats();
+    s.epoch_retired = Epoch::Instance().retired();
+    s.epoch_retired_bytes = Epoch::Instance().retired_bytes();
+    return s;
+  }
+
+  // Resolves every tuple of these classes now. Offsets of classes with
+  // virtual bases can only be read from an object, that's done once per class
+  // on the first call with it.
+  template <class ...T>
+  SealReport Seal() {
+    return Seal({&typeid(T)...});
+  }
+
+  SealReport Seal(const std::vector<const std::type_info*> &types) {
+    sealed_.Register(table_, types);
+    SealReport report;
+    sealed_.foreach_unresolved([&](const partial &p, bool ambiguous) {
+        (ambiguous ? report.ambiguous : report.missing).push_back(p);
+      });
+    return report;
   }
 
-  template <int X>
+  template <int X, class ...U>
   typename std::enable_if<X==N>::type
   inline init_find(
-      partial &real, std::array<void*, N> &objs) {}
+      partial &real, std::array<void*, N> &objs, const U & ...rest) {}
 
+  // Real types and whole objects of the arguments. A final static type is
+  // the real one, so neither the type nor the offset is read from the vtable.
   template <int X, class H, class ...U>
   typename std::enable_if<(X < N)>::type
   inline init_find(partial &real, std::array<void*, N> &objs,
             const H & h, const U &  ...rest) {
-    objs[X] = get_whole(&h, real[X].type_);
+    if (__is_final(H)) {
+      real[X] = &typeid(H);
+      objs[X] = (void*)&h;
+    } else {
+      real[X] = &typeid(h);
+      objs[X] = get_whole(&h, real[X].type_);
+    }
     this->init_find<X + 1>(real, objs, rest...);
   }
 
   template <class ...U>
-  inline void_func Find(
+  inline Func Find(
       std::array<void*, N>&func_ptrs, const U& ...v) {
-    partial real{&typeid(v)...};
+    return FindStatic(leading_final<N, U...>(), func_ptrs, v...);
+  }
+
+  // Finds the functions of n calls, the argument i of the call k is
+  // *columns_i[k]. The vtables are prefetched ahead, and each distinct type
+  // tuple is only found once per batch. If groups is given, it gets the
+  // index of the distinct tuple of each call, kBatchGroups if there're too
+  // many of them.
+  static const int kBatchGroups = 64;
+  static const size_t kBatchPrefetch = 8;
+
+  template <class ...U>
+  void FindBatch(size_t n, Func *funcs, std::array<void*, N> *ptrs,
+                 int *groups, const U *const * ...columns) {
+    struct Entry {
+      bool used;
+      std::array<const std::type_info*, N> key;
+      Func func;
+      offsets_type offsets;
+    };
+    Entry entries[kBatchGroups];
+    for (auto &e : entries) e.used = false;
+    for (size_t k = 0; k < n; ++k) {
+      if (k + kBatchPrefetch < n) {
+        int dummy[] = {(prefetch_vtable(columns[k + kBatchPrefetch]), 0)...};
+        (void)dummy;
+      }
+      partial real;
+      this->init_find<0>(real, ptrs[k], *columns[k]...);
+      uint64_t h = 0;
+      for (int i = 0; i < N; ++i) {
+        h = (h ^ reinterpret_cast<uintptr_t>(real[i].type_)) *
+            0x9e3779b97f4a7c15ULL;
+      }
+      int g = kBatchGroups;
+      for (int p = 0; p < kBatchGroups; ++p) {
+        int at = ((h >> 32) + p) & (kBatchGroups - 1);
+        auto &e = entries[at];
+        if (!e.used) {
+          auto objs = ptrs[k];
+          e.func = Find(real, ptrs[k]);
+          for (int i = 0; i < N; ++i) {
+            e.key[i] = real[i].type_;
+            e.offsets[i] = (char*)ptrs[k][i] - (char*)objs[i];
+          }
+          e.used = true;
+          funcs[k] = e.func;
+          g = at;
+          break;
+        }
+        bool same = true;
+        for (int i = 0; i < N; ++i) {
+          same = same && e.key[i] == real[i].type_;
+        }
+        if (same) {
+          for (int i = 0; i < N; ++i) {
+            ptrs[k][i] = (char*)ptrs[k][i] + e.offsets[i];
+          }
+          funcs[k] = e.func;
+          g = at;
+          break;
+        }
+      }
+      if (g == kBatchGroups) funcs[k] = Find(real, ptrs[k]);
+      if (groups) groups[k] = g;
+    }
+  }
+
+  // FindBatch, then visit(func, ptrs, k) for every call, the calls with the
+  // same type tuple one after the other, so an overload stays hot.
+  template <class Visit, class ...U>
+  void DispatchBatch(size_t n, const Visit &visit,
+                     const U *const * ...columns) {
+    std::vector<Func> funcs(n);
+    std::vector<std::array<void*, N>> ptrs(n);
+    std::vector<int> groups(n);
+    FindBatch(n, funcs.data(), ptrs.data(), groups.data(), columns...);
+    // Counting sort on the groups, kBatchGroups included.
+    size_t starts[kBatchGroups + 2] = {0};
+    for (size_t k = 0; k < n; ++k) ++starts[groups[k] + 1];
+    for (int g = 1; g < kBatchGroups + 2; ++g) starts[g] += starts[g - 1];
+    std::vector<size_t> order(n);
+    for (size_t k = 0; k < n; ++k) order[starts[groups[k]]++] = k;
+    for (auto k : order) visit(funcs[k], ptrs[k], k);
+  }
+
+ private:
+  template <class ...U>
+  inline Func FindStatic(std::false_type, std::array<void*, N> &func_ptrs,
+                         const U & ...v) {
+    partial real;
     std::array<void*, N> objs;
     this->init_find<0>(real, objs, v...);
     return Find(real, objs, func_ptrs);
   }
+
+  // All the types are final, so the resolution is fixed for this
+  // instantiation, it's bound until the next Add, in one of kBoundSlots slots
+  // by instance id. A slot is taken by the first instance calling, the
+  // others sharing it go through Find, without rebinding it, so with more
+  // than kBoundSlots live instances of a signature called with the same
+  // final types, some of them always pay for the thread cache or resolved_.
+  template <class ...U>
+  inline Func FindStatic(std::true_type, std::array<void*, N> &func_ptrs,
+                         const U & ...v) {
+    struct Bound {
+      uint64_t id;
+      uint64_t generation;
+      Func func;
+      offsets_type offsets;
+    };
+    static std::atomic<Bound *> bound[kBoundSlots];
+    auto &slot = bound[id_ % kBoundSlots];
+    partial real;
+    std::array<void*, N> objs;
+    this->init_find<0>(real, objs, v...);
+    auto generation = generation_.load(std::memory_order_acquire);
+    {
+      EpochGuard guard;
+      auto b = slot.load(std::memory_order_acquire);
+      if (b && b->id == id_ && b->generation == generation) {
+        if (profile_.load(std::memory_order_relaxed)) Count(real);
+        for (int i = 0; i < N; ++i) {
+          func_ptrs[i] = (char*)objs[i] + b->offsets[i];
+        }
+        return b->func;
+      }
+      if (b && b->id != id_) return Find(real, objs, func_ptrs);
+    }
+    auto func = Find(real, objs, func_ptrs);
+    auto b = new Bound{id_, generation, func, offsets_type()};
+    for (int i = 0; i < N; ++i) {
+      b->offsets[i] = (char*)func_ptrs[i] - (char*)objs[i];
+    }
+    Bound *old;
+    {
+      EpochGuard guard;
+      old = slot.load(std::memory_order_acquire);
+      do {
+        if (old && (old->id != id_ || old->generation >= generation)) {
+          // Taken by another instance, or bound again meanwhile.
+          delete b;
+          return func;
+        }
+      } while (!slot.compare_exchange_weak(old, b,
+                                           std::memory_order_acq_rel));
+    }
+    if (old) {
+      Epoch::Instance().Retire(old, [](void *p) { delete (Bound*)p; },
+                               sizeof(Bound));
+    }
+    return func;
+  }
+
+  template <class T>
+  static inline void prefetch_vtable(const T *p) {
+    __builtin_prefetch(*reinterpret_cast<const void *const*>(p));
+  }
 };
 
 }  // namespace multi_method
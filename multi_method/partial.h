@@ -2,8 +2,10 @@
 #define FILE_820D4736_731E_4394_83D4_787BEFACE734_H
 
 #include "multi_method/bases.h"
+#include "multi_method/registry.h"
 #include "multi_method/table.h"
 
+#include <array>
 #include <vector>
 #include <string>
 #include <algorithm>
@@ -27,14 +29,7 @@ struct TypePartial {
   }
 
   bool operator>(const TypePartial & o) const {
-    if (type_ == o.type_) return false;
-    Bases tbs(type_);
-    for (int i = 0; i < tbs.size(); ++i) {
-      auto t = tbs.base_at(i);
-      TypePartial tp(t);
-      if (tp >= o) return true;
-    }
-    return false;
+    return type_ != o.type_ && IsSubtype(type_, o.type_);
   }
 
   bool operator<(const TypePartial & o) const {
@@ -42,14 +37,7 @@ struct TypePartial {
   }
 
   bool operator>=(const TypePartial & o) const {
-    if (type_ == o.type_) return true;
-    Bases tbs(type_);
-    for (int i = 0; i < tbs.size(); ++i) {
-      auto t = tbs.base_at(i);
-      TypePartial tp(t);
-      if (tp >= o) return true;
-    }
-    return false;
+    return IsSubtype(type_, o.type_);
   }
 
   bool operator<=(const TypePartial & o) const {
@@ -112,13 +100,16 @@ struct PartialArray {
 template <int N>
 using TypePartialArray = PartialArray<TypePartial, N>;
 
+// Order sensitive, so (B, C) and (C, B) don't collide, the table mixes the
+// result again.
 template <int N>
 struct TableHash<TypePartialArray<N>> {
   inline size_t operator()(const TypePartialArray<N> &v) {
-    size_t h = 0;
+    uint64_t h = 0;
     for (int i = 0; i < N; ++i) {
-      h += reinterpret_cast<intptr_t>(v.values_[i].type_);
-      h ^= (reinterpret_cast<intptr_t>(v.values_[i].type_) >> 4);
+      h = (h ^ reinterpret_cast<uintptr_t>(v.values_[i].type_)) *
+          0x9e3779b97f4a7c15ULL;
+      h ^= h >> 29;
     }
     return h;
   }
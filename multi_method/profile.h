@@ -0,0 +1,177 @@
+#ifndef FILE_3B8E5D72_A4C1_4F09_86D3_E1F74A2C9B05_H
+#define FILE_3B8E5D72_A4C1_4F09_86D3_E1F74A2C9B05_H
+// Profile guided dispatch: a MultiMethod counts its calls by real tuple, and
+// GenerateDispatch writes a function testing the hottest tuples first, by
+// their type_info pointers, and calling their overloads directly, so they can
+// be inlined. Other tuples go to the given fallback, usually the Find.
+//
+// Overloads are called by name, found with dladdr, so the binary profiled
+// must export them (-rdynamic), or by names given for the overloads. Types are
+// named by their demangled names, the generated code needs their
+// definitions, and is only valid while the overloads are the same.
+//
+// Usage:
+//   mm_mat_add.EnableProfile();
+//   ... a representative run ...
+//   multi_method::WriteDispatch(mm_mat_add, "mat_add_hot.h", "mat_add_hot", 4);
+//
+//   // Next build, after including the matrix types, their overloads, and
+//   // mat_add_hot.h:
+//   Matrix *mat_add(const Matrix &a, const Matrix &b) {
+//     return mat_add_hot<Matrix*>(mat_add_find, a, b);
+//   }
+
+#include "multi_method/multi_method.h"
+
+#include <cstdio>
+#include <functional>
+#include <string>
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <unistd.h>
+
+namespace multi_method {
+
+// The object of type Pos in a, whose most derived type is Real, so through a
+// virtual base too.
+template <class Real, class Pos, class A>
+inline const Pos &hot_cast(const A &a) {
+  return *static_cast<const Real*>(get_whole(&a, &typeid(Real)));
+}
+
+inline std::string Demangle(const char *name) {
+  int status = 0;
+  char *s = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+  std::string r = status == 0 && s ? s : name;
+  free(s);
+  return r;
+}
+
+// "int f<A, B>(A const&, B const&)" to "f<A, B>", empty if it's not an
+// exported symbol.
+inline std::string FunctionName(void_func func) {
+  Dl_info info;
+  if (!dladdr((void*)func, &info) || !info.dli_sname ||
+      info.dli_saddr != (void*)func) {
+    return "";
+  }
+  auto name = Demangle(info.dli_sname);
+  size_t start = 0, end = name.size();
+  int depth = 0;
+  for (size_t i = 0; i < name.size(); ++i) {
+    char c = name[i];
+    if (c == '<') {
+      ++depth;
+    } else if (c == '>') {
+      --depth;
+    } else if (depth == 0 && c == ' ') {
+      start = i + 1;
+    } else if (depth == 0 && c == '(') {
+      end = i;
+      break;
+    }
+  }
+  return name.substr(start, end - start);
+}
+
+template <class MM>
+using OverloadNamer = std::function<std::string(
+    const typename MM::partial &, const typename MM::func_type &)>;
+
+// The source of a function template
+//   template <class R, class F, class A0, ..., class ...E>
+//   R name(F &&fallback, const A0 &a0, ..., E &&...e);
+// testing the top most called tuples of mm, in that order.
+template <class MM>
+std::string GenerateDispatch(MM &mm, const std::string &name, size_t top,
+                             OverloadNamer<MM> overload_name = nullptr) {
+  const int N = MM::arity;
+  if (!overload_name) {
+    overload_name = [](const typename MM::partial &,
+                       const typename MM::func_type &func) {
+      return FunctionName(reinterpret_cast<void_func>(func));
+    };
+  }
+  auto profile = mm.Profile();
+  uint64_t total = 0, hot = 0;
+  for (auto &p : profile) total += p.second;
+  auto percent = [&](uint64_t n) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.1f%%", total ? 100.0 * n / total : 0.0);
+    return std::string(buf);
+  };
+
+  std::string body;
+  size_t tuples = 0;
+  for (auto &p : profile) {
+    if (tuples == top) break;
+    auto &real = p.first;
+    auto best = mm.Best(real, {});
+    auto func = best.method.status == Resolution::kResolved ?
+        overload_name(best.pos, best.method.func) : std::string();
+    if (func.empty()) {
+      body += "  // " + to_str(real) + ", " + percent(p.second) +
+          ", no overload to call.\n";
+      continue;
+    }
+    ++tuples;
+    hot += p.second;
+    body += "  // " + percent(p.second) + "\n  if (";
+    for (int i = 0; i < N; ++i) {
+      if (i) body += " &&\n      ";
+      body += "t" + std::to_string(i) + " == &typeid(" +
+          Demangle(real[i].type_->name()) + ")";
+    }
+    body += ") {\n    return " + func + "(";
+    for (int i = 0; i < N; ++i) {
+      body += "\n        ::multi_method::hot_cast<" +
+          Demangle(real[i].type_->name()) + ", " +
+          Demangle(best.pos[i].type_->name()) + ">(a" + std::to_string(i) +
+          "),";
+    }
+    body += "\n        std::forward<E>(e)...);\n  }\n";
+  }
+
+  std::string out =
+      "// Generated by multi_method::GenerateDispatch, " +
+      std::to_string(tuples) + " tuples of " +
+      std::to_string(profile.size()) + ", " + percent(hot) + " of " +
+      std::to_string(total) + " calls.\n"
+      "#include \"multi_method/profile.h\"\n\n"
+      "template <class R, class F";
+  for (int i = 0; i < N; ++i) out += ", class A" + std::to_string(i);
+  out += ", class ...E>\ninline R " + name + "(F &&fallback";
+  for (int i = 0; i < N; ++i) {
+    out += ", const A" + std::to_string(i) + " &a" + std::to_string(i);
+  }
+  out += ", E &&...e) {\n";
+  for (int i = 0; i < N; ++i) {
+    out += "  const std::type_info *t" + std::to_string(i) + " = &typeid(a" +
+        std::to_string(i) + ");\n";
+  }
+  out += body + "  return fallback(";
+  for (int i = 0; i < N; ++i) out += "a" + std::to_string(i) + ", ";
+  out += "std::forward<E>(e)...);\n}\n";
+  return out;
+}
+
+template <class MM>
+bool WriteDispatch(MM &mm, const std::string &path, const std::string &name,
+                   size_t top, OverloadNamer<MM> overload_name = nullptr) {
+  auto out = GenerateDispatch(mm, name, top, overload_name);
+  // Written aside then renamed, like the snapshots.
+  auto tmp = path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f) return false;
+  bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace multi_method
+#endif // FILE_3B8E5D72_A4C1_4F09_86D3_E1F74A2C9B05_H
@@ -0,0 +1,90 @@
+#ifndef FILE_3AA82E29_CFDE_4142_AFD4_33BD16C0F64A_H
+#define FILE_3AA82E29_CFDE_4142_AFD4_33BD16C0F64A_H
+// Process wide registry giving each class a small dense id, bases are always
+// registered before, so they have smaller ids than their derived classes.
+//
+// Each class also keeps a bit vector of its bases (itself included), indexed by
+// id, so a subtype test is a bit test. It's only as long as the class id, the
+// whole costs ids^2/2 bits.
+
+#include "multi_method/bases.h"
+#include "multi_method/table.h"
+
+namespace multi_method {
+
+struct ClassInfo {
+  const std::type_info *type_;
+  int id_;
+  std::vector<uint64_t> bases_;
+
+  bool derives_from(const ClassInfo &b) const {
+    return b.id_ <= id_ && ((bases_[b.id_ / 64] >> (b.id_ % 64)) & 1);
+  }
+};
+
+struct ClassRegistry {
+  Table<const std::type_info*, ClassInfo*> classes_;
+  std::mutex mutex_;
+  std::atomic<int> size_;
+
+  ClassRegistry() : size_(0) {}
+
+  static ClassRegistry &Instance() {
+    static ClassRegistry registry;
+    return registry;
+  }
+
+  int size() const {
+    return size_.load(std::memory_order_acquire);
+  }
+
+  const ClassInfo *Find(const std::type_info *type) {
+    return classes_.Find(type);
+  }
+
+  const ClassInfo *Register(const std::type_info *type) {
+    auto info = classes_.Find(type);
+    if (info) return info;
+    std::lock_guard<std::mutex> lk(mutex_);
+    return RegisterLocked(type);
+  }
+
+ private:
+  const ClassInfo *RegisterLocked(const std::type_info *type) {
+    auto info = classes_.Find(type);
+    if (info) return info;
+    int id = size_.load(std::memory_order_relaxed);
+    std::vector<uint64_t> bits;
+    Bases bs(type);
+    for (int i = 0; i < bs.size(); ++i) {
+      auto b = RegisterLocked(bs.base_at(i));
+      id = size_.load(std::memory_order_relaxed);
+      bits.resize(id / 64 + 1);
+      for (size_t w = 0; w < b->bases_.size(); ++w) {
+        bits[w] |= b->bases_[w];
+      }
+    }
+    bits.resize(id / 64 + 1);
+    bits[id / 64] |= uint64_t(1) << (id % 64);
+    auto n = new ClassInfo{type, id, std::move(bits)};
+    classes_.Add(type, n);
+    size_.store(n->id_ + 1, std::memory_order_release);
+    return n;
+  }
+};
+
+// Whether a is b or derives from b, through any base.
+inline bool IsSubtype(const std::type_info *a, const std::type_info *b) {
+  if (a == b) return true;
+  if (!a || !b) return false;
+  auto &registry = ClassRegistry::Instance();
+  return registry.Register(a)->derives_from(*registry.Register(b));
+}
+
+template <class T>
+inline int RegisterClass() {
+  return ClassRegistry::Instance().Register(&typeid(T))->id_;
+}
+
+}  // namespace multi_method
+#endif // FILE_3AA82E29_CFDE_4142_AFD4_33BD16C0F64A_H
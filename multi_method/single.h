@@ -0,0 +1,128 @@
+#ifndef FILE_2C8D5F1A_6B3E_4E97_8D40_A9F1E5C7B312_H
+#define FILE_2C8D5F1A_6B3E_4E97_8D40_A9F1E5C7B312_H
+// Front cache of MultiMethod<1>, keyed directly by the type_info pointer.
+//
+// Open addressing over slots of {key, func, offset}, a slot is written once,
+// key last with release, so a hit is one acquire load and a compare, under
+// an EpochGuard. It's insert only, growing or clearing publishes a new state,
+// and retires the old one through the Epoch, like Table.
+//
+// Each state is for one generation of the MultiMethod, a resolution found in
+// an older one is not inserted.
+
+#include "multi_method/epoch.h"
+#include "multi_method/table.h"
+
+#include <memory>
+#include <typeinfo>
+
+namespace multi_method {
+
+template <class Func>
+struct SingleDispatchTable {
+  struct Slot {
+    std::atomic<const std::type_info*> key;
+    Func func;
+    ptrdiff_t offset;
+  };
+
+  struct State {
+    uint64_t generation;
+    size_t mask;
+    size_t size;
+    std::unique_ptr<Slot[]> slots;
+
+    State(uint64_t g, size_t buckets)
+        : generation(g), mask(buckets - 1), size(0), slots(new Slot[buckets]) {
+      for (size_t i = 0; i < buckets; ++i) {
+        slots[i].key.store(nullptr, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  std::atomic<State *> state_;
+  std::mutex mutex_;
+
+  explicit SingleDispatchTable(uint64_t generation)
+      : state_(new State(generation, 16)) {}
+
+  ~SingleDispatchTable() {
+    delete state_.load();
+  }
+
+  SingleDispatchTable(const SingleDispatchTable &) = delete;
+  SingleDispatchTable &operator=(const SingleDispatchTable &) = delete;
+
+  static inline size_t hash(const std::type_info *type) {
+    return mix_hash(reinterpret_cast<uintptr_t>(type));
+  }
+
+  inline bool Find(const std::type_info *type, void *&ptr, Func &func) const {
+    EpochGuard guard;
+    auto s = state_.load(std::memory_order_acquire);
+    for (size_t i = hash(type) & s->mask;; i = (i + 1) & s->mask) {
+      auto key = s->slots[i].key.load(std::memory_order_acquire);
+      if (key == type) {
+        ptr = (char*)ptr + s->slots[i].offset;
+        func = s->slots[i].func;
+        return true;
+      }
+      if (!key) return false;
+    }
+  }
+
+  void Insert(const std::type_info *type, const Func &func, ptrdiff_t offset,
+              uint64_t generation) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto s = state_.load(std::memory_order_relaxed);
+    if (s->generation != generation) return;
+    if ((s->size + 1) * 2 > s->mask + 1) {
+      std::unique_ptr<State> n(new State(generation, (s->mask + 1) * 2));
+      for (size_t i = 0; i <= s->mask; ++i) {
+        auto key = s->slots[i].key.load(std::memory_order_relaxed);
+        if (key) Put(n.get(), key, s->slots[i].func, s->slots[i].offset);
+      }
+      state_.store(n.get(), std::memory_order_release);
+      Retire(s);
+      s = n.release();
+    }
+    Put(s, type, func, offset);
+  }
+
+  // Starts an empty state for this generation.
+  void Clear(uint64_t generation) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto s = state_.load(std::memory_order_relaxed);
+    // Readers never look at the generation.
+    if (s->size == 0) {
+      s->generation = generation;
+      return;
+    }
+    state_.store(new State(generation, 16), std::memory_order_release);
+    Retire(s);
+  }
+
+ private:
+  static void Retire(State *s) {
+    Epoch::Instance().Retire(s, [](void *p) { delete (State*)p; },
+                             sizeof(State) + (s->mask + 1) * sizeof(Slot));
+  }
+
+  static void Put(State *s, const std::type_info *type, const Func &func,
+                  ptrdiff_t offset) {
+    for (size_t i = hash(type) & s->mask;; i = (i + 1) & s->mask) {
+      auto &slot = s->slots[i];
+      auto key = slot.key.load(std::memory_order_relaxed);
+      if (key == type) return;
+      if (key) continue;
+      slot.func = func;
+      slot.offset = offset;
+      slot.key.store(type, std::memory_order_release);
+      ++s->size;
+      return;
+    }
+  }
+};
+
+}  // namespace multi_method
+#endif // FILE_2C8D5F1A_6B3E_4E97_8D40_A9F1E5C7B312_H
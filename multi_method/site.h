@@ -0,0 +1,102 @@
+#ifndef FILE_CBBDCB87_9AFB_49E1_AB0A_46122111C8EF_H
+#define FILE_CBBDCB87_9AFB_49E1_AB0A_46122111C8EF_H
+// Inline cache for one call site, it remembers the last few real type tuples
+// seen there, and only goes to MultiMethod::Find when none matches. Hits are
+// counted in the profile too.
+//
+// It's not thread safe, keep one per thread:
+//   int add(const V &a, const V &b) {
+//     static thread_local multi_method::DispatchSite<decltype(mm_add)> site;
+//     std::array<void*, 2> ptrs;
+//     auto fp = site.Find(mm_add, ptrs, a, b);
+//     ...
+//   }
+//
+// The type is trivial, so a static or thread_local site is zero initialized
+// without any guard.
+
+#include "multi_method/multi_method.h"
+
+namespace multi_method {
+
+template <class MM, int K = 4>
+struct DispatchSite {
+  static const int N = MM::arity;
+  typedef typename MM::func_type func_type;
+  typedef typename MM::partial partial;
+
+  struct Entry {
+    std::array<const std::type_info*, N> key;
+    func_type func;
+    std::array<ptrdiff_t, N> offsets;
+  };
+
+  Entry entries_[K];
+  int size_;
+  int next_;
+  // Generation of mm when the entries were found, an Add drops them.
+  uint64_t generation_;
+
+  inline func_type Find(MM &mm, const partial &real,
+                        std::array<void*, N> &ptrs) {
+    auto generation = mm.generation_.load(std::memory_order_acquire);
+    if (generation != generation_) {
+      Clear();
+      generation_ = generation;
+    }
+    for (int k = 0; k < K; ++k) {
+      if (k == size_) break;
+      auto &e = entries_[k];
+      if (Match(e, real)) {
+        if (mm.profile_.load(std::memory_order_relaxed)) mm.Count(real);
+        for (int i = 0; i < N; ++i) {
+          ptrs[i] = (char*)ptrs[i] + e.offsets[i];
+        }
+        return e.func;
+      }
+    }
+    return Miss(mm, real, ptrs);
+  }
+
+  template <class ...U>
+  inline func_type Find(MM &mm, std::array<void*, N> &func_ptrs,
+                        const U & ...v) {
+    partial real;
+    mm.template init_find<0>(real, func_ptrs, v...);
+    return Find(mm, real, func_ptrs);
+  }
+
+  void Clear() {
+    size_ = 0;
+    next_ = 0;
+  }
+
+ private:
+  static bool Match(const Entry &e, const partial &real) {
+    for (int i = 0; i < N; ++i) {
+      if (e.key[i] != real[i].type_) return false;
+    }
+    return true;
+  }
+
+  func_type Miss(MM &mm, const partial &real, std::array<void*, N> &ptrs) {
+    auto whole = ptrs;
+    auto func = mm.Find(real, ptrs);
+    Entry *e;
+    if (size_ < K) {
+      e = &entries_[size_++];
+    } else {
+      e = &entries_[next_];
+      next_ = (next_ + 1) % K;
+    }
+    for (int i = 0; i < N; ++i) {
+      e->key[i] = real[i].type_;
+      e->offsets[i] = (char*)ptrs[i] - (char*)whole[i];
+    }
+    e->func = func;
+    return func;
+  }
+};
+
+}  // namespace multi_method
+#endif // FILE_CBBDCB87_9AFB_49E1_AB0A_46122111C8EF_H
@@ -0,0 +1,265 @@
+#ifndef FILE_9E47B2D1_0C6A_4F83_A5E2_71D8C3B64F20_H
+#define FILE_9E47B2D1_0C6A_4F83_A5E2_71D8C3B64F20_H
+// Snapshot of the resolutions of a MultiMethod, to warm resolved_ at startup
+// instead of resolving again the tuples the last process already saw.
+//
+// Types are saved by their mangled names, overloads by their type tuples, so
+// function addresses don't need to be the same. The loader maps the file,
+// finds the types among the registered classes, the overloads of the method,
+// or the dynamic symbols (_ZTI<name>, when linked with -rdynamic), and skips
+// an entry when:
+//   a type or its overload is not there any more,
+//   an overload added since applies to it, so it could resolve differently,
+//   an offset doesn't match the layout,
+//   a class has virtual bases and no object of it was seen yet, so its
+//   layout is not known, such entries are only loaded once it is.
+//
+// Usage:
+//   multi_method::ExportSnapshot(mm_mat_add, "mat_add.snapshot", version);
+//   ...
+//   multi_method::ImportSnapshot(mm_mat_add, "mat_add.snapshot", version);
+
+#include "multi_method/multi_method.h"
+
+#include <cstdio>
+#include <map>
+#include <string>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace multi_method {
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t arity;
+  uint32_t offset_size;
+  uint32_t build_size;
+  uint32_t names;
+  uint32_t overloads;
+  uint32_t entries;
+};
+
+static const char kSnapshotMagic[8] = {'M', 'M', 'S', 'N', 'A', 'P', 0, 1};
+static const uint32_t kSnapshotVersion = 1;
+
+struct SnapshotResult {
+  // False if the file can't be read, or is not for this method and build.
+  bool ok;
+  size_t loaded;
+  size_t skipped;
+};
+
+// Layout, each name is a uint32 size and the bytes:
+//   header, build, names,
+//   overloads: N name indices each,
+//   entries: N name indices of the real types, N of the overload, N int64
+//            offsets.
+template <class MM>
+bool ExportSnapshot(MM &mm, const std::string &path,
+                    const std::string &build = "") {
+  const int N = MM::arity;
+  typedef typename MM::partial partial;
+  typedef typename MM::ResolvedMethod resolved;
+  std::map<const std::type_info*, uint32_t> ids;
+  std::vector<const std::type_info*> names;
+  auto id = [&](const std::type_info *t) {
+    auto it = ids.insert({t, (uint32_t)names.size()}).first;
+    if (it->second == names.size()) names.push_back(t);
+    return it->second;
+  };
+  std::vector<uint32_t> overloads;
+  mm.table_.foreach([&](const partial &p, const typename MM::func_type &) {
+      for (int i = 0; i < N; ++i) overloads.push_back(id(p[i].type_));
+    });
+  std::vector<uint32_t> tuples;
+  std::vector<int64_t> offsets;
+  std::vector<partial> reals;
+  mm.resolved_.foreach([&](const partial &real, const resolved &m) {
+      if (m.status == Resolution::kResolved) reals.push_back(real);
+    });
+  for (auto &real : reals) {
+    // Overloads aren't kept in resolved_, found again with the cached
+    // layouts.
+    auto best = mm.Best(real, {});
+    if (best.method.status != Resolution::kResolved) continue;
+    for (int i = 0; i < N; ++i) tuples.push_back(id(real[i].type_));
+    for (int i = 0; i < N; ++i) tuples.push_back(id(best.pos[i].type_));
+    for (int i = 0; i < N; ++i) offsets.push_back(best.method.offsets[i]);
+  }
+
+  std::string out;
+  auto put = [&](const void *p, size_t n) {
+    out.append((const char*)p, n);
+  };
+  SnapshotHeader h;
+  memcpy(h.magic, kSnapshotMagic, sizeof(h.magic));
+  h.version = kSnapshotVersion;
+  h.arity = N;
+  h.offset_size = sizeof(ptrdiff_t);
+  h.build_size = build.size();
+  h.names = names.size();
+  h.overloads = overloads.size() / N;
+  h.entries = offsets.size() / N;
+  put(&h, sizeof(h));
+  put(build.data(), build.size());
+  for (auto t : names) {
+    uint32_t n = strlen(t->name());
+    put(&n, sizeof(n));
+    put(t->name(), n);
+  }
+  put(overloads.data(), overloads.size() * sizeof(uint32_t));
+  for (uint32_t e = 0; e < h.entries; ++e) {
+    put(&tuples[e * 2 * N], 2 * N * sizeof(uint32_t));
+    put(&offsets[e * N], N * sizeof(int64_t));
+  }
+
+  // Written aside then renamed, a reader never sees half a file.
+  auto tmp = path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f) return false;
+  bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// The type_info of a mangled name, among the registered classes, the types of
+// the overloads, or the dynamic symbols.
+template <class MM>
+std::map<std::string, const std::type_info*> SnapshotTypes(MM &mm) {
+  std::map<std::string, const std::type_info*> types;
+  ClassRegistry::Instance().classes_.foreach(
+      [&](const std::type_info *t, ClassInfo *) {
+        types[t->name()] = t;
+      });
+  mm.table_.foreach([&](const typename MM::partial &p,
+                        const typename MM::func_type &) {
+      for (int i = 0; i < MM::arity; ++i) types[p[i].type_->name()] = p[i].type_;
+    });
+  return types;
+}
+
+inline const std::type_info *SnapshotSymbol(const std::string &name) {
+  return (const std::type_info*)dlsym(RTLD_DEFAULT, ("_ZTI" + name).c_str());
+}
+
+template <class MM>
+SnapshotResult ImportSnapshot(MM &mm, const std::string &path,
+                              const std::string &build = "") {
+  const int N = MM::arity;
+  typedef typename MM::partial partial;
+  typedef typename MM::ResolvedMethod resolved;
+  SnapshotResult result = {false, 0, 0};
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return result;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return result;
+  }
+  size_t size = st.st_size;
+  auto base = (const char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return result;
+
+  const char *p = base, *end = base + size;
+  auto get = [&](void *out, size_t n) {
+    if ((size_t)(end - p) < n) return false;
+    memcpy(out, p, n);
+    p += n;
+    return true;
+  };
+  SnapshotHeader h;
+  bool ok = get(&h, sizeof(h)) &&
+      memcmp(h.magic, kSnapshotMagic, sizeof(h.magic)) == 0 &&
+      h.version == kSnapshotVersion && h.arity == (uint32_t)N &&
+      h.offset_size == sizeof(ptrdiff_t) && h.build_size == build.size() &&
+      (size_t)(end - p) >= h.build_size &&
+      build.compare(0, build.size(), p, h.build_size) == 0;
+  if (ok) p += h.build_size;
+
+  auto known = SnapshotTypes(mm);
+  std::vector<const std::type_info*> types;
+  for (uint32_t k = 0; ok && k < h.names; ++k) {
+    uint32_t n;
+    ok = get(&n, sizeof(n)) && (size_t)(end - p) >= n;
+    if (!ok) break;
+    std::string name(p, n);
+    p += n;
+    auto it = known.find(name);
+    types.push_back(it != known.end() ? it->second : SnapshotSymbol(name));
+  }
+  auto type_at = [&](uint32_t k) -> const std::type_info* {
+    return k < types.size() ? types[k] : nullptr;
+  };
+
+  // Overloads added since the export.
+  std::vector<partial> saved, added;
+  for (uint32_t k = 0; ok && k < h.overloads; ++k) {
+    uint32_t ids[N];
+    ok = get(ids, sizeof(ids));
+    partial o;
+    for (int i = 0; ok && i < N; ++i) o[i] = type_at(ids[i]);
+    saved.push_back(o);
+  }
+  mm.table_.foreach([&](const partial &o, const typename MM::func_type &) {
+      if (std::find(saved.begin(), saved.end(), o) == saved.end()) {
+        added.push_back(o);
+      }
+    });
+
+  std::lock_guard<std::mutex> lk(mm.resolve_mutex_);
+  for (uint32_t e = 0; ok && e < h.entries; ++e) {
+    uint32_t ids[2 * N];
+    int64_t offsets[N];
+    ok = get(ids, sizeof(ids)) && get(offsets, sizeof(offsets));
+    if (!ok) break;
+    partial real, pos;
+    resolved m = resolved();
+    bool valid = true;
+    for (int i = 0; i < N; ++i) {
+      real[i] = type_at(ids[i]);
+      pos[i] = type_at(ids[N + i]);
+      m.offsets[i] = offsets[i];
+      valid = valid && real[i].type_ && pos[i].type_ &&
+          IsSubtype(real[i].type_, pos[i].type_) &&
+          offsets[i] == m.offsets[i];
+    }
+    if (valid) m.func = mm.table_.Find(pos);
+    valid = valid && !!m.func;
+    for (auto &o : added) {
+      valid = valid && !(real >= o);
+    }
+    // Without a layout, the offsets of a class with virtual bases can't be
+    // checked, and Best(real, {}) would need an object, so the entry is left
+    // to the first call.
+    for (int i = 0; valid && i < N; ++i) {
+      Bases bs(real[i].type_);
+      auto layout = bs.has_virtual_bases() ?
+          bs.cached_layout() : &bs.layout(nullptr);
+      ptrdiff_t offset;
+      valid = layout && layout->offset_of(pos[i].type_, offset) &&
+          offset == m.offsets[i];
+    }
+    if (!valid) {
+      ++result.skipped;
+      continue;
+    }
+    m.status = Resolution::kResolved;
+    if (mm.resolved_.Add(real, m).second) ++result.loaded;
+  }
+  munmap((void*)base, size);
+  result.ok = ok;
+  return result;
+}
+
+}  // namespace multi_method
+#endif // FILE_9E47B2D1_0C6A_4F83_A5E2_71D8C3B64F20_H
@@ -0,0 +1,223 @@
+#ifndef FILE_D84F2B6E_17A3_4C5D_B0E9_6A3C92F1E874_H
+#define FILE_D84F2B6E_17A3_4C5D_B0E9_6A3C92F1E874_H
+// Multi method over a closed set of classes, resolved at compile time.
+//
+// The classes and the overloads are template arguments, so the most specific
+// overload of every tuple of classes is chosen while compiling, a tuple with
+// none, or without a unique one, is a compile error. The resolutions are a
+// constexpr table of direct calls, a call is the index of each real type, and
+// one indirect call. The index is found by comparing the type_info with the
+// ones of the classes when they're a few, or else in a map by type_info
+// pointer built on the first call. Nothing is resolved at runtime.
+//
+// Every real type must be one of the classes, a call with another one aborts.
+//
+// Usage:
+//   namespace mm = multi_method;
+//   typedef mm::StaticMultiMethod<
+//       Matrix*(mm::virtual_<const Matrix&>, mm::virtual_<const Matrix&>),
+//       mm::type_list<Matrix, DiagonalMatrix, BandedMatrix>,
+//       MULTI_METHOD_OVERLOAD(mat_add_mm), MULTI_METHOD_OVERLOAD(mat_add_md),
+//       MULTI_METHOD_OVERLOAD(mat_add_dm), MULTI_METHOD_OVERLOAD(mat_add_dd)>
+//       mat_add;
+//   std::unique_ptr<Matrix> r{mat_add::Call(a, b)};
+
+#include "multi_method/typed.h"
+
+namespace multi_method {
+
+#define MULTI_METHOD_OVERLOAD(...) \
+  ::multi_method::function_constant<decltype(&__VA_ARGS__), &__VA_ARGS__>
+
+template <int B, int E>
+struct static_pow
+    : std::integral_constant<int, B * static_pow<B, E - 1>::value> {};
+
+template <int B>
+struct static_pow<B, 0> : std::integral_constant<int, 1> {};
+
+// Object types of the N dispatched parameters of the overload O.
+template <class O, int N>
+struct overload_types
+    : leading_objects<typename function_traits<typename O::type>::params,
+                      typename make_indices<N>::type> {};
+
+// Whether each type of A converts to the one of B, a public and unambiguous
+// base, as for a MultiMethod.
+template <class A, class B>
+struct tuple_derives;
+
+template <class ...A, class ...B>
+struct tuple_derives<type_list<A...>, type_list<B...>>
+    : all_of<std::is_convertible<const A*, const B*>::value...> {};
+
+struct no_overload {};
+
+// Whether O is at least as specific as Best.
+template <class O, class Best, int N>
+struct more_specific
+    : tuple_derives<typename overload_types<O, N>::type,
+                    typename overload_types<Best, N>::type> {};
+
+template <class O, int N>
+struct more_specific<O, no_overload, N> : std::true_type {};
+
+template <class Best, int N>
+struct more_specific<no_overload, Best, N> : std::false_type {};
+
+// A most specific of the overloads applying to the classes Real.
+template <class Real, int N, class Best, class ...O>
+struct best_overload {
+  typedef Best type;
+};
+
+template <class Real, int N, class Best, class H, class ...O>
+struct best_overload<Real, N, Best, H, O...>
+    : best_overload<
+        Real, N,
+        typename std::conditional<
+          tuple_derives<Real, typename overload_types<H, N>::type>::value &&
+              more_specific<H, Best, N>::value,
+          H, Best>::type,
+        O...> {};
+
+template <class Real, int N, class ...O>
+struct static_resolution {
+  typedef typename best_overload<Real, N, no_overload, O...>::type type;
+  static_assert(!std::is_same<type, no_overload>::value,
+                "no overload applies to a tuple of the classes");
+  static_assert(
+      all_of<(!tuple_derives<Real,
+                             typename overload_types<O, N>::type>::value ||
+              more_specific<type, O, N>::value)...>::value,
+      "ambiguous overloads for a tuple of the classes");
+};
+
+template <class R, class Fn, class V, class Real, class K, class E>
+struct StaticCall;
+
+template <class R, class Fn, class ...V, class ...Real, int ...K, class ...E>
+struct StaticCall<R, Fn, type_list<V...>, type_list<Real...>, indices<K...>,
+                  type_list<E...>> {
+  typedef typename function_traits<typename Fn::type>::params params;
+
+  static R call(V... v, E... e) {
+    return static_cast<R>(Fn::get(nullptr)(
+        arg_traits<typename type_at<K, params>::type>::template from<Real>(
+            get_whole(&arg_traits<V>::object(v), &typeid(Real)))...,
+        std::forward<E>(e)...));
+  }
+};
+
+template <class Impl, class I>
+struct StaticTable;
+
+template <class Impl, int ...I>
+struct StaticTable<Impl, indices<I...>> {
+  static constexpr typename Impl::invoker cells[sizeof...(I)] = {
+    &Impl::template cell<I>::call...};
+};
+
+template <class Impl, int ...I>
+constexpr typename Impl::invoker
+StaticTable<Impl, indices<I...>>::cells[sizeof...(I)];
+
+template <class R, class V, class E, class C, class ...O>
+struct StaticMultiMethodImpl;
+
+template <class R, class ...V, class ...E, class ...C, class ...O>
+struct StaticMultiMethodImpl<R, type_list<V...>, type_list<E...>,
+                             type_list<C...>, O...> {
+  static const int N = sizeof...(V);
+  static const int M = sizeof...(C);
+  static const int kCells = static_pow<M, N>::value;
+  static_assert(N > 0, "no virtual_ argument");
+  static_assert(!any_virtual<E...>::value,
+                "virtual_ arguments must come first");
+
+  typedef type_list<C...> classes;
+  typedef R (*invoker)(V..., E...);
+
+  // The class of the position K in the cell I.
+  template <int I, int K>
+  struct cell_class
+      : type_at<I / static_pow<M, N - 1 - K>::value % M, classes> {};
+
+  template <int I, class K = typename make_indices<N>::type>
+  struct cell_call;
+
+  template <int I, int ...K>
+  struct cell_call<I, indices<K...>> {
+    typedef type_list<typename cell_class<I, K>::type...> real;
+    typedef StaticCall<R,
+                       typename static_resolution<real, N, O...>::type,
+                       type_list<V...>, real, indices<K...>,
+                       type_list<E...>> type;
+  };
+
+  template <int I>
+  struct cell : cell_call<I>::type {};
+
+  // Open addressing from the type_info of each class to its index.
+  struct ClassIndex {
+    static const size_t kSlots = pow2_ceil(2 * M);
+    const std::type_info *keys[kSlots];
+    int values[kSlots];
+
+    ClassIndex() {
+      const std::type_info *types[] = {&typeid(C)...};
+      for (auto &k : keys) k = nullptr;
+      for (int c = 0; c < M; ++c) {
+        size_t i = mix_hash((uintptr_t)types[c]) & (kSlots - 1);
+        while (keys[i]) i = (i + 1) & (kSlots - 1);
+        keys[i] = types[c];
+        values[i] = c;
+      }
+    }
+  };
+
+  // Up to this many classes, comparing them all is faster than a probe.
+  static const int kScan = 4;
+
+  static inline int index(const std::type_info *type) {
+    if (M <= kScan) {
+      const std::type_info *types[] = {&typeid(C)...};
+      for (int i = 0; i < M; ++i) {
+        if (types[i] == type) return i;
+      }
+      abort();
+    }
+    static const ClassIndex classes;
+    const size_t mask = ClassIndex::kSlots - 1;
+    for (size_t i = mix_hash((uintptr_t)type) & mask;; i = (i + 1) & mask) {
+      if (classes.keys[i] == type) return classes.values[i];
+      if (!classes.keys[i]) abort();
+    }
+  }
+
+  static inline R Call(V... v, E... e) {
+    const std::type_info *types[] = {&typeid(arg_traits<V>::object(v))...};
+    int c = 0;
+    for (int i = 0; i < N; ++i) c = c * M + index(types[i]);
+    return StaticTable<StaticMultiMethodImpl,
+                       typename make_indices<kCells>::type>::cells[c](
+        v..., std::forward<E>(e)...);
+  }
+
+  inline R operator()(V... v, E... e) const {
+    return Call(v..., std::forward<E>(e)...);
+  }
+};
+
+template <class Sig, class Classes, class ...O>
+struct StaticMultiMethod;
+
+template <class R, class ...A, class ...C, class ...O>
+struct StaticMultiMethod<R(A...), type_list<C...>, O...>
+    : StaticMultiMethodImpl<R,
+                            typename split_virtual<type_list<>, A...>::virtuals,
+                            typename split_virtual<type_list<>, A...>::extras,
+                            type_list<C...>, O...> {};
+
+}  // namespace multi_method
+#endif // FILE_D84F2B6E_17A3_4C5D_B0E9_6A3C92F1E874_H
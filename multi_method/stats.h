@@ -0,0 +1,186 @@
+#ifndef FILE_6A1E0C37_52D4_4F0B_9B8E_3C2D7F41A9E6_H
+#define FILE_6A1E0C37_52D4_4F0B_9B8E_3C2D7F41A9E6_H
+// Opt-in counters of MultiMethod and Table, compiled in with
+// -DMULTI_METHOD_STATS. Without it nothing is counted, Stats() still has the
+// sizes of the tables, and enabled false.
+//
+// Each thread adds to its own shard of an instance with relaxed atomics, the
+// shards are only summed by a snapshot. Times and probe lengths are kept as
+// histograms.
+//
+// Usage:
+//   auto stats = mm_mat_add.Stats();
+//   metrics << stats.to_json();
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#ifdef MULTI_METHOD_STATS
+#define MULTI_METHOD_STAT(...) __VA_ARGS__
+#else
+#define MULTI_METHOD_STAT(...)
+#endif
+
+namespace multi_method {
+
+struct StatCounter {
+  std::atomic<uint64_t> value_;
+
+  StatCounter() : value_(0) {}
+
+  inline void Add(uint64_t n = 1) {
+    value_.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  uint64_t get() const {
+    return value_.load(std::memory_order_relaxed);
+  }
+};
+
+inline unsigned ThreadShard() {
+  static std::atomic<unsigned> next(0);
+  static thread_local unsigned shard = next.fetch_add(1);
+  return shard;
+}
+
+template <class Shard>
+struct Sharded {
+  static const int kShards = 32;
+
+  // Padded, so two threads don't write to the same cache line.
+  struct Padded {
+    Shard shard_;
+    char pad_[64];
+  };
+
+  Padded shards_[kShards];
+
+  inline Shard &Local() {
+    return shards_[ThreadShard() % kShards].shard_;
+  }
+
+  template <class F>
+  void foreach(const F &func) const {
+    for (auto &p : shards_) func(p.shard_);
+  }
+};
+
+// Bucket b counts the values in [2^b, 2^(b+1)), the last one also the larger.
+inline int log2_bucket(uint64_t v, int buckets) {
+  int b = 63 - __builtin_clzll(v | 1);
+  return b < buckets ? b : buckets - 1;
+}
+
+inline std::string json_array(const uint64_t *values, int n) {
+  std::string ret = "[";
+  for (int i = 0; i < n; ++i) {
+    if (i > 0) ret += ",";
+    ret += std::to_string(values[i]);
+  }
+  return ret + "]";
+}
+
+struct TableStats {
+  static const int kProbeBuckets = 8;
+
+  uint64_t finds = 0;
+  uint64_t misses = 0;
+  // probes[k] is the number of Finds which looked at k + 1 groups, the last
+  // one counts the longer too.
+  uint64_t probes[kProbeBuckets] = {};
+  uint64_t resizes = 0;
+  // Of all the states retired by this table, freed or not.
+  uint64_t retired_bytes = 0;
+  size_t size = 0;
+  size_t buckets = 0;
+  size_t bytes = 0;
+
+  std::string to_json() const {
+    return "{\"finds\":" + std::to_string(finds) +
+        ",\"misses\":" + std::to_string(misses) +
+        ",\"probes\":" + json_array(probes, kProbeBuckets) +
+        ",\"resizes\":" + std::to_string(resizes) +
+        ",\"retired_bytes\":" + std::to_string(retired_bytes) +
+        ",\"size\":" + std::to_string(size) +
+        ",\"buckets\":" + std::to_string(buckets) +
+        ",\"bytes\":" + std::to_string(bytes) + "}";
+  }
+};
+
+struct TableShard {
+  StatCounter finds_;
+  StatCounter misses_;
+  StatCounter probes_[TableStats::kProbeBuckets];
+
+  inline void Find(size_t groups, bool found) {
+    finds_.Add();
+    if (!found) misses_.Add();
+    probes_[groups < TableStats::kProbeBuckets ?
+            groups - 1 : TableStats::kProbeBuckets - 1].Add();
+  }
+};
+
+struct MultiMethodStats {
+  static const int kTimeBuckets = 32;
+
+  bool enabled = false;
+  // Found without resolving, by the first place which had it.
+  uint64_t single_hits = 0;
+  uint64_t sealed_hits = 0;
+  uint64_t thread_cache_hits = 0;
+  uint64_t resolved_hits = 0;
+  // The slow path, resolve_ns[b] counts the ones which took [2^b, 2^(b+1))
+  // nano seconds.
+  uint64_t resolutions = 0;
+  uint64_t resolve_ns[kTimeBuckets] = {};
+  // Misses which waited for another thread resolving the same tuple.
+  uint64_t resolve_waits = 0;
+  TableStats overloads;
+  TableStats resolved;
+  // States retired by any table and not freed yet.
+  uint64_t epoch_retired = 0;
+  uint64_t epoch_retired_bytes = 0;
+
+  uint64_t hits() const {
+    return single_hits + sealed_hits + thread_cache_hits + resolved_hits;
+  }
+
+  std::string to_json() const {
+    return std::string("{\"enabled\":") + (enabled ? "true" : "false") +
+        ",\"single_hits\":" + std::to_string(single_hits) +
+        ",\"sealed_hits\":" + std::to_string(sealed_hits) +
+        ",\"thread_cache_hits\":" + std::to_string(thread_cache_hits) +
+        ",\"resolved_hits\":" + std::to_string(resolved_hits) +
+        ",\"resolutions\":" + std::to_string(resolutions) +
+        ",\"resolve_ns\":" + json_array(resolve_ns, kTimeBuckets) +
+        ",\"resolve_waits\":" + std::to_string(resolve_waits) +
+        ",\"overloads\":" + overloads.to_json() +
+        ",\"resolved\":" + resolved.to_json() +
+        ",\"epoch_retired\":" + std::to_string(epoch_retired) +
+        ",\"epoch_retired_bytes\":" + std::to_string(epoch_retired_bytes) +
+        "}";
+  }
+};
+
+struct MultiMethodShard {
+  StatCounter single_hits_;
+  StatCounter sealed_hits_;
+  StatCounter thread_cache_hits_;
+  StatCounter resolved_hits_;
+  StatCounter resolutions_;
+  StatCounter resolve_ns_[MultiMethodStats::kTimeBuckets];
+  StatCounter resolve_waits_;
+
+  inline void Resolved(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    resolutions_.Add();
+    resolve_ns_[log2_bucket(elapsed.count(),
+                            MultiMethodStats::kTimeBuckets)].Add();
+  }
+};
+
+}  // namespace multi_method
+#endif // FILE_6A1E0C37_52D4_4F0B_9B8E_3C2D7F41A9E6_H
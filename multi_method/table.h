@@ -2,7 +2,19 @@
 #define FILE_5BC057F4_76D1_4834_81DF_7DED6F0EDB9E_H
 #include <functional>
 #include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
 #include <mutex>
+#include <thread>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "multi_method/arena.h"
+#include "multi_method/epoch.h"
+#include "multi_method/stats.h"
 
 namespace multi_method {
 
@@ -33,131 +45,351 @@ struct TableHash<T *> {
   }
 };
 
+// Mixes the bits of a hash, the table uses the low bits to choose the group,
+// and the 7 high bits as the control byte.
+inline size_t mix_hash(size_t h) {
+  uint64_t x = (uint64_t)h * 0x9e3779b97f4a7c15ULL;
+  return (size_t)(x ^ (x >> 32));
+}
+
+// Swiss table like layout, a control byte per slot, empty or 7 bits of the
+// hash, probed a group of 16 at a time, then the keys, then the values, so a
+// lookup only touches the control bytes and the keys until it hits.
+//
+// Readers never lock. A writer claims the first empty slot of its probe by a
+// CAS of the control byte to kBusy, writes the key and value, then publishes
+// the slot by storing the hash bits. Slots are never emptied, so two writers
+// of the same key meet at the slot of the first one, the second waits for it
+// to be published, and finds the key there.
+//
+// Resizes and rebuilds are serialized by mutex_, they seal the state, wait for
+// the writers in it, and publish a new state by state_, the old one is then
+// retired to the Epoch, and freed when no reader may still be in it. Writers
+// which find the state sealed wait on mutex_, then go on in the new one.
 template <class Key, class Value, class Hash=TableHash<Key>,
-          class DeleteValue=ValueFree<Value>>
+          class DeleteValue=ValueFree<Value>, class Alloc=StateArena>
 struct Table {
+  static const size_t kGroup = 16;
+  static const uint8_t kEmpty = 0x80;
+  static const uint8_t kBusy = 0xff;
+
   struct State {
-    State * old;
-    size_t size;
+    // Claimed slots, including the ones being written.
+    std::atomic<size_t> size;
     size_t buckets;
-    std::pair<Key, Value> table[0];
+    std::atomic<int> writers;
+    std::atomic<bool> sealed;
+    std::atomic<uint8_t> *ctrl;
+    Key *keys;
+    Value *values;
   };
+
   std::atomic<State *> state_;
-  std::mutex add_mutex_;
+  std::mutex mutex_;
+#ifdef MULTI_METHOD_STATS
+  Sharded<TableShard> stats_;
+  StatCounter resizes_;
+  StatCounter retired_bytes_;
+#endif
 
-  Table() {
-    const size_t buckets = 8;
-    auto state = (State*)calloc(sizeof(State) + sizeof(state_.load()->table[0]) * buckets, 1);
+  static size_t align_up(size_t n, size_t a) {
+    return (n + a - 1) / a * a;
+  }
+
+  static const size_t kCacheLine = 64;
+
+  // The arrays start on cache lines, so an entry whose size is a power of two,
+  // up to a cache line, is never split between two of them.
+  static size_t StateBytes(size_t buckets) {
+    size_t ctrl = align_up(sizeof(State), kGroup);
+    size_t keys = align_up(ctrl + buckets, kCacheLine);
+    size_t values = align_up(keys + sizeof(Key) * buckets, kCacheLine);
+    return align_up(values + sizeof(Value) * buckets, kCacheLine);
+  }
+
+  static State *NewState(size_t buckets) {
+    size_t ctrl = align_up(sizeof(State), kGroup);
+    size_t keys = align_up(ctrl + buckets, kCacheLine);
+    size_t values = align_up(keys + sizeof(Key) * buckets, kCacheLine);
+    char *p = (char*)Alloc::Allocate(StateBytes(buckets));
+    memset(p, 0, StateBytes(buckets));
+    auto state = (State*)p;
     state->buckets = buckets;
-    state_.store(state);
+    state->ctrl = (std::atomic<uint8_t>*)(p + ctrl);
+    state->keys = (Key*)(p + keys);
+    state->values = (Value*)(p + values);
+    memset((void*)state->ctrl, kEmpty, buckets);
+    return state;
+  }
+
+  static void FreeState(void *state) {
+    Alloc::Free(state);
+  }
+
+  // Hash bits, not empty nor busy.
+  static inline bool full(uint8_t c) {
+    return !(c & 0x80);
+  }
+
+  Table() {
+    state_.store(NewState(kGroup));
   }
 
   ~Table() {
     DeleteValue delete_value;
     auto state = state_.load();
     for (size_t i = 0; i < state->buckets; ++i) {
-      auto &kv = state->table[i];
-      if (kv.first != Key()) {
-        delete_value(kv.second);
+      if (full(state->ctrl[i].load(std::memory_order_relaxed))) {
+        delete_value(state->values[i]);
       }
     }
-    while (state) {
-      auto old = state->old;
-      free(state);
-      state = old;
+    FreeState(state);
+  }
+
+  // Bit i set when the control byte i of the group is c. The group is read
+  // by two relaxed atomic loads, groups are aligned to kGroup, so a writer's
+  // CAS of a byte is not a data race, and the result is only a hint, a match
+  // is confirmed with an acquire load of the byte.
+  static inline unsigned match(const std::atomic<uint8_t> *group, uint8_t c) {
+#ifdef __SSE2__
+    auto words = (const uint64_t*)group;
+    __m128i ctrl = _mm_set_epi64x(
+        (long long)__atomic_load_n(words + 1, __ATOMIC_RELAXED),
+        (long long)__atomic_load_n(words, __ATOMIC_RELAXED));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)c)));
+#else
+    unsigned m = 0;
+    for (size_t i = 0; i < kGroup; ++i) {
+      if (group[i].load(std::memory_order_relaxed) == c) m |= 1u << i;
     }
+    return m;
+#endif
   }
 
   template <class F>
   void foreach_check(const F & func) {
+    EpochGuard guard;
     auto s = state_.load();
     for (size_t b = 0; b < s->buckets; ++b) {
-      auto &o = s->table[b];
-      if (o.first == Key()) continue;
-      if (!func(o.first, o.second)) break;
+      if (!full(s->ctrl[b].load(std::memory_order_acquire))) continue;
+      if (!func(s->keys[b], s->values[b])) break;
     }
   }
 
   template <class F>
   void foreach_check(const F & func) const {
-    const_cast<Table*>(this)->foreach_check(std::forward<F>(func));
+    const_cast<Table*>(this)->foreach_check(func);
   }
 
   template <class F>
   void foreach(const F & func) {
+    EpochGuard guard;
     auto s = state_.load();
     for (size_t b = 0; b < s->buckets; ++b) {
-      auto &o = s->table[b];
-      if (o.first == Key()) continue;
-      func(o.first, o.second);
+      if (!full(s->ctrl[b].load(std::memory_order_acquire))) continue;
+      func(s->keys[b], s->values[b]);
     }
   }
 
   template <class F>
   void foreach(const F & func) const {
-    const_cast<Table*>(this)->foreach(std::forward<F>(func));
+    const_cast<Table*>(this)->foreach(func);
   }
 
   Value Find(const Key &k) {
-    auto state = state_.load(std::memory_order_relaxed);
-    size_t b = Hash()(k) & (state->buckets - 1);
+    EpochGuard guard;
+    auto state = state_.load();
+    size_t h = mix_hash(Hash()(k));
+    uint8_t c = h >> (sizeof(size_t) * 8 - 7);
+    size_t mask = state->buckets / kGroup - 1;
+    size_t g = h & mask;
     size_t idx = 0;
     while (1) {
-      auto &o = state->table[b];
-      if (o.first == k) {
-        return o.second;
+      auto group = state->ctrl + g * kGroup;
+      for (unsigned m = match(group, c); m; m &= m - 1) {
+        size_t i = __builtin_ctz(m);
+        if (group[i].load(std::memory_order_acquire) != c) continue;
+        if (state->keys[g * kGroup + i] == k) {
+          MULTI_METHOD_STAT(stats_.Local().Find(idx + 1, true));
+          return state->values[g * kGroup + i];
+        }
       }
-      if (o.first == Key()) break;
-      b = (b + ++idx) & (state->buckets - 1);
+      if (match(group, kEmpty)) break;
+      g = (g + ++idx) & mask;
     }
+    MULTI_METHOD_STAT(stats_.Local().Find(idx + 1, false));
     return Value();
   }
 
+  size_t size() const {
+    return state_.load()->size;
+  }
+
+  size_t buckets() const {
+    return state_.load()->buckets;
+  }
+
+  // Memory of the current state, the retired ones are not counted.
+  size_t bytes() const {
+    return StateBytes(buckets());
+  }
+
+  TableStats Stats() const {
+    TableStats s;
+#ifdef MULTI_METHOD_STATS
+    stats_.foreach([&](const TableShard &shard) {
+        s.finds += shard.finds_.get();
+        s.misses += shard.misses_.get();
+        for (int i = 0; i < TableStats::kProbeBuckets; ++i) {
+          s.probes[i] += shard.probes_[i].get();
+        }
+      });
+    s.resizes = resizes_.get();
+    s.retired_bytes = retired_bytes_.get();
+#endif
+    s.size = size();
+    s.buckets = buckets();
+    s.bytes = bytes();
+    return s;
+  }
+
   void Resize(int dir) {
     assert(dir == 1);
-    auto old = state_.load(std::memory_order_acquire);
-    size_t buckets = old->buckets * 2;
-    State *state = (State*)malloc(sizeof(State) + sizeof(old->table[0]) * buckets);
-    state->old = old;
-    state->size = old->size;
-    state->buckets = buckets;
-    for (size_t i = 0; i < buckets; ++i) {
-      state->table[i].first = Key();
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto old = state_.load(std::memory_order_relaxed);
+    Migrate(old, old->buckets * 2, [](const Key &, const Value &v) {
+        return v;
+      });
+    MULTI_METHOD_STAT(resizes_.Add());
+  }
+
+  // Copies the table to a new state, with func(key, value) as the value, the
+  // readers keep the old one until the new is published. Replaced values are
+  // not deleted.
+  template <class F>
+  void Rebuild(const F &func) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto old = state_.load(std::memory_order_relaxed);
+    Migrate(old, old->buckets, func);
+  }
+
+  // The value in the table, and whether it's added.
+  std::pair<Value, bool> Add(const Key &k, const Value &value) {
+    EpochGuard guard;
+    size_t h = mix_hash(Hash()(k));
+    uint8_t c = h >> (sizeof(size_t) * 8 - 7);
+    while (1) {
+      auto state = state_.load(std::memory_order_acquire);
+      state->writers.fetch_add(1);
+      if (!state->sealed.load()) {
+        std::pair<Value, bool> r;
+        bool done = Claim(state, h, c, k, value, r);
+        state->writers.fetch_sub(1, std::memory_order_release);
+        if (done) return r;
+        // Full, the first one here grows it.
+        std::lock_guard<std::mutex> lk(mutex_);
+        if (state_.load(std::memory_order_relaxed) == state) {
+          Migrate(state, state->buckets * 2, [](const Key &, const Value &v) {
+              return v;
+            });
+          MULTI_METHOD_STAT(resizes_.Add());
+        }
+        continue;
+      }
+      state->writers.fetch_sub(1, std::memory_order_release);
+      // Being copied, the new state is published when mutex_ is released.
+      std::lock_guard<std::mutex> lk(mutex_);
     }
-    for (size_t i = 0; i < old->buckets; ++i) {
-      auto &o = old->table[i];
-      if (o.first == Key()) continue;
-      size_t b = Hash()(o.first) & (state->buckets - 1);
-      size_t idx = 0;
-      while (state->table[b].first != Key()) {
-        b = (b + ++idx) & (state->buckets - 1);
+  }
+
+ private:
+  // Adds k, or finds it, into r, false if the state is too full to claim a
+  // slot. The caller is counted in the writers of the state.
+  static bool Claim(State *state, size_t h, uint8_t c, const Key &k,
+                    const Value &value, std::pair<Value, bool> &r) {
+    size_t mask = state->buckets / kGroup - 1;
+    size_t g = h & mask;
+    size_t idx = 0;
+    bool reserved = false;
+    while (1) {
+      auto group = state->ctrl + g * kGroup;
+      // The claimed slots of a group are a prefix, so are the ones to check.
+      unsigned empty = match(group, kEmpty);
+      unsigned before = empty ? (empty & -empty) - 1 : 0xffff;
+      for (unsigned m = before; m; m &= m - 1) {
+        size_t i = g * kGroup + __builtin_ctz(m);
+        uint8_t b = state->ctrl[i].load(std::memory_order_acquire);
+        while (b == kBusy) {
+          std::this_thread::yield();
+          b = state->ctrl[i].load(std::memory_order_acquire);
+        }
+        if (b == c && state->keys[i] == k) {
+          if (reserved) state->size.fetch_sub(1, std::memory_order_relaxed);
+          r = std::pair<Value, bool>{state->values[i], false};
+          return true;
+        }
       }
-      state->table[b] = o;
+      if (!empty) {
+        g = (g + ++idx) & mask;
+        continue;
+      }
+      // Reserved before claiming, so a probe always ends on an empty slot.
+      if (!reserved) {
+        if ((state->size.fetch_add(1, std::memory_order_relaxed) + 1) * 8 >
+            7 * state->buckets) {
+          state->size.fetch_sub(1, std::memory_order_relaxed);
+          return false;
+        }
+        reserved = true;
+      }
+      size_t i = g * kGroup + __builtin_ctz(empty);
+      uint8_t expected = kEmpty;
+      // Lost to another writer, check what it writes, then go on.
+      if (!state->ctrl[i].compare_exchange_strong(expected, kBusy)) continue;
+      state->keys[i] = k;
+      state->values[i] = value;
+      state->ctrl[i].store(c, std::memory_order_release);
+      r = std::pair<Value, bool>{value, true};
+      return true;
     }
-    state_.store(state, std::memory_order_release);
   }
 
-  std::pair<Value&, bool> Add(const Key &k, const Value &value) {
-    std::lock_guard<std::mutex> lk(add_mutex_);
-    auto state = state_.load(std::memory_order_acquire);
-    if (state->size * 5 >= 4 * state->buckets) {
-      Resize(1);
-      state = state_.load(std::memory_order_relaxed);
+  // Seals old, waits for its writers, then publishes a copy with buckets
+  // slots. Called with mutex_ held.
+  template <class F>
+  void Migrate(State *old, size_t buckets, const F &func) {
+    old->sealed.store(true);
+    while (old->writers.load() != 0) std::this_thread::yield();
+    State *state = NewState(buckets);
+    for (size_t i = 0; i < old->buckets; ++i) {
+      uint8_t c = old->ctrl[i].load(std::memory_order_acquire);
+      if (!full(c)) continue;
+      Insert(state, old->keys[i], func(old->keys[i], old->values[i]), c);
     }
-    size_t b = Hash()(k) & (state->buckets - 1);
+    state_.store(state, std::memory_order_release);
+    MULTI_METHOD_STAT(retired_bytes_.Add(StateBytes(old->buckets)));
+    Epoch::Instance().Retire(old, &FreeState, StateBytes(old->buckets));
+  }
+
+  // Into a state not published yet.
+  static void Insert(State *state, const Key &k, const Value &value,
+                     uint8_t c) {
+    size_t h = mix_hash(Hash()(k));
+    size_t mask = state->buckets / kGroup - 1;
+    size_t g = h & mask;
     size_t idx = 0;
     while (1) {
-      auto &o = state->table[b];
-      if (o.first == k) {
-        return std::pair<Value&, bool>{o.second, false};
-      }
-      if (o.first == Key()) {
-        o.second = value;
-        o.first = k;
-        ++state->size;
-        return std::pair<Value&, bool>{o.second, true};
+      auto group = state->ctrl + g * kGroup;
+      unsigned m = match(group, kEmpty);
+      if (m) {
+        size_t i = g * kGroup + __builtin_ctz(m);
+        state->keys[i] = k;
+        state->values[i] = value;
+        state->size.fetch_add(1, std::memory_order_relaxed);
+        state->ctrl[i].store(c, std::memory_order_relaxed);
+        return;
       }
-      b = (b + ++idx) & (state->buckets - 1);
+      g = (g + ++idx) & mask;
     }
   }
 };
@@ -0,0 +1,361 @@
+#ifndef FILE_C6E1A9B4_3F27_4D85_9A0C_58B2E7D41F96_H
+#define FILE_C6E1A9B4_3F27_4D85_9A0C_58B2E7D41F96_H
+// Multi method on tagged values, without RTTI nor vtables.
+//
+// A tagged type says which alternative it holds with an integer tag, through
+// tag_traits. Overloads take the alternatives, a base of some of them, or the
+// tagged type itself for any alternative, and Add fills a dense table of
+// every tag tuple, so a call is the tags, two loads and an indirect call.
+// The table points to cells owned by the overloads, so an Add only changes
+// the pointers in place, nothing is freed until the destructor.
+//
+// A tuple is given the overload accepting the fewest alternatives at every
+// position, the tuples without a unique one call abort, Find tells them.
+//
+// Usage:
+//   struct Shape {
+//     typedef mm::type_list<Circle, Square> alternatives;
+//     int index() const { return kind; }
+//     template <int I> const typename mm::type_at<I, alternatives>::type &
+//     get() const;
+//     ...
+//   };
+//   mm::TaggedMultiMethod<double(mm::virtual_<const Shape&>,
+//                                mm::virtual_<const Shape&>)> overlap;
+//   overlap.Add(overlap_any);  // (const Shape&, const Shape&)
+//   overlap.Add(overlap_cc);   // (const Circle&, const Circle&)
+//   overlap.Add(MULTI_METHOD_FN(overlap_cs));
+//   double r = overlap(a, b);
+//
+// std::variant is supported as is when built as C++17.
+
+#include "multi_method/typed.h"
+
+#if __cplusplus >= 201703L
+#include <variant>
+#endif
+
+namespace multi_method {
+
+// The default is for types with alternatives, index() and get<I>().
+template <class T>
+struct tag_traits {
+  typedef typename T::alternatives alternatives;
+
+  static inline int tag(const T &v) {
+    return v.index();
+  }
+
+  template <int I>
+  static inline const void *get(const T &v) {
+    return &v.template get<I>();
+  }
+};
+
+#if __cplusplus >= 201703L
+template <class ...A>
+struct tag_traits<std::variant<A...>> {
+  typedef type_list<A...> alternatives;
+
+  static inline int tag(const std::variant<A...> &v) {
+    return v.index();
+  }
+
+  template <int I>
+  static inline const void *get(const std::variant<A...> &v) {
+    return &std::get<I>(v);
+  }
+};
+#endif
+
+template <class T>
+struct tag_count;
+
+template <class ...A>
+struct tag_count<type_list<A...>>
+    : std::integral_constant<int, sizeof...(A)> {};
+
+template <class L>
+struct tag_product;
+
+template <>
+struct tag_product<type_list<>> : std::integral_constant<int, 1> {};
+
+template <class H, class ...T>
+struct tag_product<type_list<H, T...>>
+    : std::integral_constant<
+        int, tag_count<typename tag_traits<H>::alternatives>::value *
+                 tag_product<type_list<T...>>::value> {};
+
+template <int K, class L>
+struct drop_front {
+  typedef L type;
+};
+
+template <int K, class H, class ...T>
+struct drop_front<K, type_list<H, T...>>
+    : std::conditional<K == 0, type_list<H, T...>,
+                       typename drop_front<K - 1, type_list<T...>>::type> {};
+
+template <int K>
+struct drop_front<K, type_list<>> {
+  typedef type_list<> type;
+};
+
+// The alternative of the tagged type T at position K in the cell C.
+template <int C, int K, class L>
+struct cell_tag {
+  typedef typename type_at<K, L>::type tagged;
+  static const int value =
+      C / tag_product<typename drop_front<K + 1, L>::type>::value %
+      tag_count<typename tag_traits<tagged>::alternatives>::value;
+};
+
+// Whether a parameter of type U takes the alternative A of T.
+template <class U, class T, class A>
+struct tag_accepts
+    : std::integral_constant<bool, std::is_same<U, T>::value ||
+                                       std::is_same<U, A>::value ||
+                                       std::is_base_of<U, A>::value> {};
+
+template <class U, class T, class L>
+struct tag_mask;
+
+template <class U, class T>
+struct tag_mask<U, T, type_list<>> : std::integral_constant<uint64_t, 0> {};
+
+template <class U, class T, class H, class ...A>
+struct tag_mask<U, T, type_list<H, A...>>
+    : std::integral_constant<
+        uint64_t, (tag_accepts<U, T, H>::value ? 1 : 0) |
+                      (tag_mask<U, T, type_list<A...>>::value << 1)> {};
+
+// The argument of type P for the tagged value v, when U takes the
+// alternative I.
+template <class P, class U, class T, int I,
+          bool Whole = std::is_same<U, T>::value>
+struct tag_arg {
+  static P get(const T &v) {
+    typedef typename type_at<I, typename tag_traits<T>::alternatives>::type
+        alternative;
+    return arg_traits<P>::template from<alternative>(
+        const_cast<void*>(tag_traits<T>::template get<I>(v)));
+  }
+};
+
+template <class P, class U, class T, int I>
+struct tag_arg<P, U, T, I, true> {
+  static P get(const T &v) {
+    return arg_traits<P>::template from<T>(const_cast<T*>(&v));
+  }
+};
+
+template <class R, class Fn, class V, class T, class U, class I, class K,
+          class E>
+struct TagTrampoline;
+
+template <class R, class Fn, class ...V, class ...T, class ...U, int ...I,
+          int ...K, class ...E>
+struct TagTrampoline<R, Fn, type_list<V...>, type_list<T...>, type_list<U...>,
+                     indices<I...>, indices<K...>, type_list<E...>> {
+  typedef typename function_traits<typename Fn::type>::params params;
+
+  static R call(void_func f, V... v, E... e) {
+    return static_cast<R>(Fn::get(f)(
+        tag_arg<typename type_at<K, params>::type, U, T, I>::get(
+            arg_traits<V>::object(v))...,
+        std::forward<E>(e)...));
+  }
+};
+
+template <class R, class V, class E>
+struct TaggedMultiMethodImpl;
+
+template <class R, class ...V, class ...E>
+struct TaggedMultiMethodImpl<R, type_list<V...>, type_list<E...>> {
+  static const int N = sizeof...(V);
+  static_assert(N > 0, "no virtual_ argument");
+  static_assert(!any_virtual<E...>::value,
+                "virtual_ arguments must come first");
+
+  typedef type_list<typename arg_traits<V>::object_type...> tagged;
+  static const int kCells = tag_product<tagged>::value;
+
+  typedef R (*invoker)(void_func, V..., E...);
+
+  struct Cell {
+    void_func func;
+    invoker invoke;
+  };
+
+  struct Overload {
+    uint64_t masks[N];
+    // By cell, a null invoke where it doesn't apply.
+    std::unique_ptr<Cell[]> cells;
+  };
+
+  std::atomic<const Cell *> cells_[kCells];
+  Cell missing_;
+  std::mutex mutex_;
+  std::vector<Overload> overloads_;
+
+  TaggedMultiMethodImpl() : missing_{nullptr, &Missing} {
+    Rebuild();
+  }
+
+  TaggedMultiMethodImpl(const TaggedMultiMethodImpl &) = delete;
+  TaggedMultiMethodImpl &operator=(const TaggedMultiMethodImpl &) = delete;
+
+  template <class ...U, class F>
+  int Add(F func) {
+    return AddImpl<function_runtime<F>>(
+        reinterpret_cast<void_func>(func), dispatch_types<F, U...>());
+  }
+
+  template <class ...U, class F, F f>
+  int Add(function_constant<F, f>) {
+    return AddImpl<function_constant<F, f>>(
+        reinterpret_cast<void_func>(f), dispatch_types<F, U...>());
+  }
+
+  static inline int cell(V... v) {
+    const int counts[] = {
+      tag_count<typename tag_traits<
+        typename arg_traits<V>::object_type>::alternatives>::value...};
+    const int tags[] = {
+      tag_traits<typename arg_traits<V>::object_type>::tag(
+          arg_traits<V>::object(v))...};
+    int c = 0;
+    for (int i = 0; i < N; ++i) {
+      assert((unsigned)tags[i] < (unsigned)counts[i]);
+      c = c * counts[i] + tags[i];
+    }
+    return c;
+  }
+
+  // A null func if no overload, or no unique most specific one applies.
+  inline const Cell &Find(V... v) const {
+    return *cells_[cell(v...)].load(std::memory_order_acquire);
+  }
+
+  inline R operator()(V... v, E... e) {
+    const Cell &c = Find(v...);
+    return c.invoke(c.func, v..., std::forward<E>(e)...);
+  }
+
+ private:
+  static R Missing(void_func, V..., E...) {
+    abort();
+  }
+
+  template <class F, class ...U>
+  static type_list<U...> dispatch_types(
+      typename std::enable_if<(sizeof...(U) > 0), F>::type * = nullptr) {
+    return {};
+  }
+
+  template <class F, class ...U>
+  static typename leading_objects<typename function_traits<F>::params,
+                                  typename make_indices<N>::type>::type
+  dispatch_types(
+      typename std::enable_if<(sizeof...(U) == 0), F>::type * = nullptr) {
+    return {};
+  }
+
+  template <class Fn, int C, class ...U, int ...K>
+  static invoker CellInvoker(indices<K...>) {
+    typedef TagTrampoline<R, Fn, type_list<V...>, tagged, type_list<U...>,
+                          indices<cell_tag<C, K, tagged>::value...>,
+                          indices<K...>, type_list<E...>> trampoline;
+    return CellCall<trampoline>(std::integral_constant<bool, all_of<
+        tag_accepts<U, typename type_at<K, tagged>::type,
+                    typename type_at<cell_tag<C, K, tagged>::value,
+                                     typename tag_traits<typename type_at<
+                                       K, tagged>::type>::alternatives>
+                    ::type>::value...>::value>());
+  }
+
+  template <class Trampoline>
+  static invoker CellCall(std::true_type) {
+    return &Trampoline::call;
+  }
+
+  // Not instantiated, the alternatives don't convert to the parameters.
+  template <class Trampoline>
+  static invoker CellCall(std::false_type) {
+    return nullptr;
+  }
+
+  template <class Fn, class ...U, int ...C>
+  static std::vector<invoker> CellInvokers(indices<C...>) {
+    return {CellInvoker<Fn, C, U...>(typename make_indices<N>::type())...};
+  }
+
+  template <class Fn, class ...U>
+  int AddImpl(void_func func, type_list<U...>) {
+    static_assert(sizeof...(U) == N, "wrong number of types");
+    static_assert(all_of<(tag_count<typename tag_traits<
+                           typename arg_traits<V>::object_type>
+                           ::alternatives>::value <= 64)...>::value,
+                  "more than 64 alternatives");
+    Overload o = {
+      {tag_mask<U, typename arg_traits<V>::object_type,
+                typename tag_traits<typename arg_traits<V>::object_type>
+                ::alternatives>::value...},
+      std::unique_ptr<Cell[]>(new Cell[kCells])};
+    auto invokers =
+        CellInvokers<Fn, U...>(typename make_indices<kCells>::type());
+    for (int c = 0; c < kCells; ++c) o.cells[c] = {func, invokers[c]};
+    std::lock_guard<std::mutex> lk(mutex_);
+    // Same alternatives as an overload already there, kept like
+    // MultiMethod::Add keeps the first one.
+    for (auto &p : overloads_) {
+      if (dominates(p, o) && dominates(o, p)) return 1;
+    }
+    overloads_.push_back(std::move(o));
+    Rebuild();
+    return 1;
+  }
+
+  // Whether a is at least as specific as b at every position.
+  static bool dominates(const Overload &a, const Overload &b) {
+    for (int i = 0; i < N; ++i) {
+      if ((a.masks[i] & b.masks[i]) != a.masks[i]) return false;
+    }
+    return true;
+  }
+
+  // Points every cell to the one of its overload, a call racing with it
+  // sees the old cell or the new one.
+  void Rebuild() {
+    for (int c = 0; c < kCells; ++c) {
+      const Overload *best = nullptr;
+      for (auto &o : overloads_) {
+        if (!o.cells[c].invoke) continue;
+        if (!best || dominates(o, *best)) best = &o;
+      }
+      bool unique = best != nullptr;
+      for (auto &o : overloads_) {
+        if (unique && o.cells[c].invoke && &o != best &&
+            !dominates(*best, o)) {
+          unique = false;
+        }
+      }
+      cells_[c].store(unique ? &best->cells[c] : &missing_,
+                      std::memory_order_release);
+    }
+  }
+};
+
+template <class Sig>
+struct TaggedMultiMethod;
+
+template <class R, class ...A>
+struct TaggedMultiMethod<R(A...)>
+    : TaggedMultiMethodImpl<R,
+                            typename split_virtual<type_list<>, A...>::virtuals,
+                            typename split_virtual<type_list<>, A...>::extras> {
+};
+
+}  // namespace multi_method
+#endif // FILE_C6E1A9B4_3F27_4D85_9A0C_58B2E7D41F96_H
@@ -0,0 +1,78 @@
+#ifndef FILE_6A5083F2_B950_4BAA_82E8_BBA24D3B0FF8_H
+#define FILE_6A5083F2_B950_4BAA_82E8_BBA24D3B0FF8_H
+// Small direct mapped cache of resolutions, one per thread and per
+// MultiMethod type, shared by all the instances of that type.
+//
+// An entry is tagged with the unique id of the instance and its generation,
+// bumping the generation invalidates all the entries of an instance, in every
+// thread, without touching them.
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <typeinfo>
+
+namespace multi_method {
+
+// Unique over the process, never 0, so a zeroed entry never matches.
+inline uint64_t NextInstanceId() {
+  static std::atomic<uint64_t> next(1);
+  return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+template <int N, class Func, int Size = 64>
+struct ThreadCache {
+  static_assert((Size & (Size - 1)) == 0, "size must be a power of 2");
+
+  struct Entry {
+    uint64_t owner;
+    uint64_t generation;
+    std::array<const std::type_info*, N> key;
+    Func func;
+    std::array<ptrdiff_t, N> offsets;
+  };
+
+  // Trivial, so zero initialized without a guard.
+  static Entry *entries() {
+    static thread_local Entry cache[Size];
+    return cache;
+  }
+
+  template <class Partial>
+  static Entry &slot(uint64_t owner, const Partial &real) {
+    uint64_t h = owner;
+    for (int i = 0; i < N; ++i) {
+      h = (h ^ reinterpret_cast<uintptr_t>(real[i].type_)) *
+          0x9e3779b97f4a7c15ULL;
+    }
+    return entries()[(h >> 32) & (Size - 1)];
+  }
+
+  template <class Partial>
+  static inline const Entry *Find(uint64_t owner, uint64_t generation,
+                                  const Partial &real) {
+    auto &e = slot(owner, real);
+    if (e.owner != owner || e.generation != generation) return nullptr;
+    for (int i = 0; i < N; ++i) {
+      if (e.key[i] != real[i].type_) return nullptr;
+    }
+    return &e;
+  }
+
+  template <class Partial, class Offsets>
+  static void Store(uint64_t owner, uint64_t generation, const Partial &real,
+                    const Func &func, const Offsets &offsets) {
+    auto &e = slot(owner, real);
+    e.owner = owner;
+    e.generation = generation;
+    for (int i = 0; i < N; ++i) {
+      e.key[i] = real[i].type_;
+      e.offsets[i] = offsets[i];
+    }
+    e.func = func;
+  }
+};
+
+}  // namespace multi_method
+#endif // FILE_6A5083F2_B950_4BAA_82E8_BBA24D3B0FF8_H
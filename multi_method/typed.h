@@ -0,0 +1,317 @@
+#ifndef FILE_41BF5383_5A6E_4206_A0AC_D173CB05619A_H
+#define FILE_41BF5383_5A6E_4206_A0AC_D173CB05619A_H
+// Typed front-end of MultiMethod, the signature says which arguments are
+// dispatched on, and the call operator finds, adjusts and invokes in one step.
+//
+// Usage:
+//   namespace mm = multi_method;
+//   mm::TypedMultiMethod<Matrix*(mm::virtual_<const Matrix&>,
+//                                mm::virtual_<const Matrix&>)> mat_add;
+//   mat_add.Add(mat_add_mm);
+//   mat_add.Add<DiagonalMatrix, DiagonalMatrix>(mat_add_dd);
+//   mat_add.Add(MULTI_METHOD_FN(mat_add_md));  // inlined into the trampoline
+//
+//   std::unique_ptr<Matrix> r{mat_add(a, b)};
+//
+//   static thread_local decltype(mat_add)::site_type site;
+//   std::unique_ptr<Matrix> s{mat_add.Call(site, a, b)};
+//
+// Dispatched arguments are references or pointers, they must come before the
+// other arguments, which are just forwarded to the overload.
+//
+// Every overload is stored with a trampoline, instantiated in Add for the
+// exact function type, the function pointer is only casted back to its own
+// type, never called through another one. The pair is the MultiMethod's
+// Func, kept inline in the resolved entries, which are padded to 32 bytes
+// either way, so a call reads it with the offsets, and with MULTI_METHOD_FN
+// the trampoline is the only indirect call.
+//
+// Under kErrorCode a call without an overload returns a value initialized R,
+// under kFallback it calls the fallback with the arguments of the call.
+
+#include "multi_method/multi_method.h"
+#include "multi_method/site.h"
+
+#include <type_traits>
+#include <utility>
+
+namespace multi_method {
+
+template <class T>
+struct virtual_ {};
+
+template <class ...T>
+struct type_list {};
+
+template <int ...I>
+struct indices {};
+
+template <int N, int ...I>
+struct make_indices : make_indices<N - 1, N - 1, I...> {};
+
+template <int ...I>
+struct make_indices<0, I...> {
+  typedef indices<I...> type;
+};
+
+template <int I, class L>
+struct type_at;
+
+template <class H, class ...T>
+struct type_at<0, type_list<H, T...>> {
+  typedef H type;
+};
+
+template <int I, class H, class ...T>
+struct type_at<I, type_list<H, T...>> : type_at<I - 1, type_list<T...>> {};
+
+// Splits a signature into the leading virtual_ arguments and the rest.
+template <class V, class ...A>
+struct split_virtual {
+  typedef V virtuals;
+  typedef type_list<A...> extras;
+};
+
+template <class ...V, class H, class ...A>
+struct split_virtual<type_list<V...>, virtual_<H>, A...>
+    : split_virtual<type_list<V..., H>, A...> {};
+
+template <bool ...B>
+struct all_of : std::true_type {};
+
+template <bool H, bool ...B>
+struct all_of<H, B...>
+    : std::integral_constant<bool, H && all_of<B...>::value> {};
+
+template <class T>
+struct is_virtual : std::false_type {};
+
+template <class T>
+struct is_virtual<virtual_<T>> : std::true_type {};
+
+template <class ...A>
+struct any_virtual : std::false_type {};
+
+template <class H, class ...A>
+struct any_virtual<H, A...>
+    : std::integral_constant<bool, is_virtual<H>::value ||
+                                       any_virtual<A...>::value> {};
+
+template <class T>
+struct arg_traits;
+
+template <class T>
+struct arg_traits<T&> {
+  typedef typename std::remove_cv<T>::type object_type;
+
+  static T& object(T &v) {
+    return v;
+  }
+
+  template <class U>
+  static T& from(void *p) {
+    return *static_cast<U*>(p);
+  }
+};
+
+template <class T>
+struct arg_traits<T*> {
+  typedef typename std::remove_cv<T>::type object_type;
+
+  static T& object(T *v) {
+    return *v;
+  }
+
+  template <class U>
+  static T* from(void *p) {
+    return static_cast<U*>(p);
+  }
+};
+
+// Object types of the first parameters, indexed by I.
+template <class L, class I>
+struct leading_objects;
+
+template <class L, int ...I>
+struct leading_objects<L, indices<I...>> {
+  typedef type_list<
+    typename arg_traits<typename type_at<I, L>::type>::object_type...> type;
+};
+
+template <class F>
+struct function_traits;
+
+template <class R, class ...P>
+struct function_traits<R (*)(P...)> {
+  typedef R result_type;
+  typedef type_list<P...> params;
+};
+
+// Function known at compile time, see MULTI_METHOD_FN.
+template <class F, F f>
+struct function_constant {
+  typedef F type;
+
+  static F get(void_func) {
+    return f;
+  }
+};
+
+#define MULTI_METHOD_FN(...) \
+  ::multi_method::function_constant<decltype(&__VA_ARGS__), &__VA_ARGS__>()
+
+template <class F>
+struct function_runtime {
+  typedef F type;
+
+  static F get(void_func f) {
+    return reinterpret_cast<F>(f);
+  }
+};
+
+template <class R, class Fn, class U, class I, class E>
+struct Trampoline;
+
+template <class R, class Fn, class ...U, int ...I, class ...E>
+struct Trampoline<R, Fn, type_list<U...>, indices<I...>, type_list<E...>> {
+  typedef typename function_traits<typename Fn::type>::params params;
+
+  static R call(void_func f, void *const *ptrs, E... e) {
+    return static_cast<R>(Fn::get(f)(
+        arg_traits<typename type_at<I, params>::type>::template from<U>(
+            ptrs[I])...,
+        std::forward<E>(e)...));
+  }
+};
+
+// What a failed call returns under kErrorCode.
+template <class R>
+struct error_value {
+  static R get() {
+    return R();
+  }
+};
+
+template <class R>
+struct error_value<R&> {
+  static R &get() {
+    abort();
+  }
+};
+
+template <class R, class V, class E>
+struct TypedMultiMethodImpl;
+
+template <class R, class ...V, class ...E>
+struct TypedMultiMethodImpl<R, type_list<V...>, type_list<E...>> {
+  static const int N = sizeof...(V);
+  static_assert(N > 0, "no virtual_ argument");
+  static_assert(!any_virtual<E...>::value,
+                "virtual_ arguments must come first");
+
+  typedef R (*invoker)(void_func, void *const *, E...);
+  typedef R (*fallback_type)(V..., E...);
+
+  struct Overload {
+    void_func func;
+    invoker invoke;
+
+    explicit operator bool() const {
+      return invoke != nullptr;
+    }
+  };
+
+  typedef MultiMethod<N, Overload> multi_method_type;
+  typedef typename multi_method_type::partial partial;
+  typedef DispatchSite<multi_method_type> site_type;
+
+  multi_method_type mm_;
+  ErrorPolicy error_policy_ = ErrorPolicy::kAbort;
+  fallback_type fallback_ = nullptr;
+
+  // kAbort and kThrow are left to the MultiMethod, kErrorCode and kFallback
+  // are handled here, since only the typed call knows what to return.
+  void SetErrorPolicy(ErrorPolicy policy, fallback_type fallback = nullptr) {
+    error_policy_ = policy;
+    fallback_ = fallback;
+    mm_.SetErrorPolicy(policy == ErrorPolicy::kFallback ?
+                       ErrorPolicy::kErrorCode : policy);
+  }
+
+  template <class ...U, class F>
+  int Add(F func) {
+    return AddImpl<function_runtime<F>>(
+        reinterpret_cast<void_func>(func), dispatch_types<F, U...>());
+  }
+
+  template <class ...U, class F, F f>
+  int Add(function_constant<F, f>) {
+    return AddImpl<function_constant<F, f>>(
+        reinterpret_cast<void_func>(f), dispatch_types<F, U...>());
+  }
+
+  inline R operator()(V... v, E... e) {
+    partial real;
+    std::array<void*, N> ptrs;
+    mm_.template init_find<0>(real, ptrs, arg_traits<V>::object(v)...);
+    const Overload o = mm_.Find(real, ptrs);
+    if (!o) return Failed(v..., std::forward<E>(e)...);
+    return o.invoke(o.func, ptrs.data(), std::forward<E>(e)...);
+  }
+
+  // Same as the call operator, but checks the call site cache first.
+  inline R Call(site_type &site, V... v, E... e) {
+    partial real;
+    std::array<void*, N> ptrs;
+    mm_.template init_find<0>(real, ptrs, arg_traits<V>::object(v)...);
+    const Overload o = site.Find(mm_, real, ptrs);
+    if (!o) return Failed(v..., std::forward<E>(e)...);
+    return o.invoke(o.func, ptrs.data(), std::forward<E>(e)...);
+  }
+
+ private:
+  R Failed(V... v, E... e) const {
+    if (error_policy_ == ErrorPolicy::kFallback && fallback_) {
+      return fallback_(v..., std::forward<E>(e)...);
+    }
+    return error_value<R>::get();
+  }
+
+  // Explicit types, or the parameter types of F.
+  template <class F, class ...U>
+  static type_list<U...> dispatch_types(
+      typename std::enable_if<(sizeof...(U) > 0), F>::type * = nullptr) {
+    return {};
+  }
+
+  template <class F, class ...U>
+  static typename leading_objects<typename function_traits<F>::params,
+                                  typename make_indices<N>::type>::type
+  dispatch_types(
+      typename std::enable_if<(sizeof...(U) == 0), F>::type * = nullptr) {
+    return {};
+  }
+
+  template <class Fn, class ...U>
+  int AddImpl(void_func func, type_list<U...>) {
+    static_assert(sizeof...(U) == N, "wrong number of types");
+    typedef Trampoline<R, Fn, type_list<U...>,
+                       typename make_indices<N>::type,
+                       type_list<E...>> trampoline;
+    return mm_.Add(partial{&typeid(U)...},
+                   Overload{func, &trampoline::call});
+  }
+};
+
+template <class Sig>
+struct TypedMultiMethod;
+
+template <class R, class ...A>
+struct TypedMultiMethod<R(A...)>
+    : TypedMultiMethodImpl<R,
+                           typename split_virtual<type_list<>, A...>::virtuals,
+                           typename split_virtual<type_list<>, A...>::extras> {
+};
+
+}  // namespace multi_method
+#endif // FILE_41BF5383_5A6E_4206_A0AC_D173CB05619A_H
@@ -0,0 +1,84 @@
+#include "multi_method/multi_method.h"
+
+#include <atomic>
+#include <iostream>
+
+namespace mm = multi_method;
+
+// Counts the allocations while set. malloc is interposed rather than the
+// global operator new, which goes through it.
+std::atomic<bool> count_mallocs{false};
+std::atomic<int> mallocs{0};
+
+extern "C" void *__libc_malloc(size_t n);
+
+extern "C" void *malloc(size_t n) {
+  if (count_mallocs.load(std::memory_order_relaxed)) ++mallocs;
+  return __libc_malloc(n);
+}
+
+struct V {
+  virtual ~V() {}
+  int value = __LINE__;
+};
+
+struct B : virtual V {
+  int value = __LINE__;
+};
+
+struct C : virtual V {
+  int value = __LINE__;
+};
+
+struct D : virtual B, virtual C {
+  int value = __LINE__;
+};
+
+template <class X, class Y>
+int add_static(const X &x, const Y &y) {
+  return x.value + y.value;
+}
+
+template <class F>
+void each_tuple(const F &func) {
+  V v; B b; C c; D d;
+  const V *all[] = {&v, &b, &c, &d};
+  for (auto x : all) {
+    for (auto y : all) func(*x, *y);
+  }
+}
+
+void add_overloads(mm::MultiMethod<2> &m) {
+  m.Add<V, V>(add_static<V, V>);
+  m.Add<B, C>(add_static<B, C>);
+  m.Add<C, B>(add_static<C, B>);
+  m.Add<D, D>(add_static<D, D>);
+}
+
+int main(int argc, char* argv[]) {
+  // The classes are registered, and their layouts read, once per process.
+  {
+    mm::MultiMethod<2> warm;
+    add_overloads(warm);
+    each_tuple([&](const V &x, const V &y) {
+        std::array<void*, 2> ptr;
+        assert(warm.Find(ptr, x, y));
+      });
+  }
+
+  // Cold misses of known classes don't allocate, the states of resolved_
+  // come from the arena.
+  mm::MultiMethod<2> m;
+  add_overloads(m);
+  mm::StateArena::Reserve(1 << 16);
+  each_tuple([&](const V &x, const V &y) {
+      std::array<void*, 2> ptr;
+      count_mallocs = true;
+      assert(m.Find(ptr, x, y));
+      count_mallocs = false;
+    });
+  assert(m.resolved_.size() == 16 && m.resolved_.buckets() > 16);
+  std::cerr << "cold miss allocations = " << mallocs.load() << std::endl;
+  assert(mallocs == 0);
+  return 0;
+}
@@ -0,0 +1,469 @@
+// Dispatch benchmarks, build with -DCMAKE_BUILD_TYPE=Release.
+//
+//   multi_method_bench [filter]
+//
+// Runs the cases whose name contains filter. The names are
+// <what>/<hierarchy>/<arity>/<mono|fn|poly|cold>:
+//   mono  the same type tuple on every call,
+//   fn    mono, with the typed overloads added through MULTI_METHOD_FN,
+//   poly  cycling over the classes of the hierarchy,
+//   cold  the first call on a new MultiMethod, so the resolution.
+#include "multi_method/multi_method.h"
+#include "multi_method/site.h"
+#include "multi_method/static.h"
+#include "multi_method/tagged.h"
+#include "multi_method/typed.h"
+#include "multi_method_bench.h"
+
+#include <memory>
+
+namespace mm = multi_method;
+
+// Three levels, Base <- Mid <- Leaf, with single, virtual or diamond
+// inheritance.
+namespace single_h {
+struct Base {
+  virtual ~Base() {}
+  virtual int id() const { return 0; }
+  int value = 1;
+};
+struct Mid : Base {
+  int id() const override { return 1; }
+};
+struct Leaf : Mid {
+  int id() const override { return 2; }
+};
+}  // namespace single_h
+
+namespace virtual_h {
+struct Base {
+  virtual ~Base() {}
+  int value = 1;
+};
+struct Mid : virtual Base {};
+struct Leaf : virtual Mid {};
+}  // namespace virtual_h
+
+namespace diamond_h {
+struct Base {
+  virtual ~Base() {}
+  int value = 1;
+};
+struct Mid : virtual Base {};
+struct Other : virtual Base {};
+struct Leaf : Mid, Other {};
+struct Final final : Leaf {};
+}  // namespace diamond_h
+
+template <class B, class M, class L>
+struct Hierarchy {
+  typedef B Base;
+  typedef M Mid;
+  typedef L Leaf;
+};
+
+typedef Hierarchy<single_h::Base, single_h::Mid, single_h::Leaf> Single;
+typedef Hierarchy<virtual_h::Base, virtual_h::Mid, virtual_h::Leaf> Virtual;
+typedef Hierarchy<diamond_h::Base, diamond_h::Mid, diamond_h::Leaf> Diamond;
+
+// Distinct per overload and not known at compile time, so the calls can't be
+// folded.
+template <class ...T>
+int overload(const T & ...v) {
+  int sum = 0;
+  int dummy[] = {(sum += v.value + (int)(uintptr_t)&typeid(T), 0)...};
+  (void)dummy;
+  return sum;
+}
+
+template <class T, int N, class ...A>
+struct repeat : repeat<T, N - 1, T, A...> {};
+
+template <class T, class ...A>
+struct repeat<T, 0, A...> {
+  typedef mm::type_list<A...> type;
+};
+
+template <class L>
+struct typed_of;
+
+template <class ...T>
+struct typed_of<mm::type_list<T...>> {
+  typedef mm::TypedMultiMethod<int(mm::virtual_<const T&>...)> type;
+};
+
+template <class MM, class ...T>
+void add_overload(MM &m, mm::type_list<T...>) {
+  m.Add(overload<T...>);
+}
+
+template <class MM, class ...T>
+void add_overload_fn(MM &m, mm::type_list<T...>) {
+  m.Add(MULTI_METHOD_FN(overload<T...>));
+}
+
+// Base^N, Mid^N and Leaf^N.
+template <class H, int N>
+struct Method {
+  typedef typename typed_of<typename repeat<typename H::Base, N>::type>::type
+  type;
+
+  static void Init(type &m) {
+    add_overload(m, typename repeat<typename H::Base, N>::type());
+    add_overload(m, typename repeat<typename H::Mid, N>::type());
+    add_overload(m, typename repeat<typename H::Leaf, N>::type());
+  }
+
+  // The same, inlined into the trampolines.
+  static void InitFn(type &m) {
+    add_overload_fn(m, typename repeat<typename H::Base, N>::type());
+    add_overload_fn(m, typename repeat<typename H::Mid, N>::type());
+    add_overload_fn(m, typename repeat<typename H::Leaf, N>::type());
+  }
+};
+
+template <class MM, class O, int ...I>
+inline int call(MM &m, O *const *objs, mm::indices<I...>) {
+  return m(*objs[I]...);
+}
+
+template <class MM, class Site, class O, int ...I>
+inline int call_site(MM &m, Site &site, O *const *objs, mm::indices<I...>) {
+  return m.Call(site, *objs[I]...);
+}
+
+// Objects of all the classes, in a fixed pseudo random order.
+template <class H>
+struct Objects {
+  typename H::Base base;
+  typename H::Mid mid;
+  typename H::Leaf leaf;
+  std::vector<const typename H::Base*> poly;
+
+  Objects() {
+    const typename H::Base *all[] = {&base, &mid, &leaf};
+    uint32_t x = 12345;
+    for (int i = 0; i < 1024; ++i) {
+      x = x * 1103515245 + 12345;
+      poly.push_back(all[(x >> 16) % 3]);
+    }
+  }
+};
+
+template <class H, int N>
+void bench_arity(const std::string &hierarchy) {
+  typedef Method<H, N> method;
+  typedef typename method::type type;
+  typedef typename mm::make_indices<N>::type indices;
+  auto prefix = "typed/" + hierarchy + "/" + std::to_string(N);
+  Objects<H> objects;
+  type m;
+  method::Init(m);
+
+  {
+    const typename H::Base *objs[N];
+    for (int i = 0; i < N; ++i) objs[i] = &objects.leaf;
+    bench::Run(prefix + "/mono", [&](size_t) {
+        return call(m, objs, indices());
+      });
+  }
+
+  {
+    type fn;
+    method::InitFn(fn);
+    const typename H::Base *objs[N];
+    for (int i = 0; i < N; ++i) objs[i] = &objects.leaf;
+    bench::Run(prefix + "/fn", [&](size_t) {
+        return call(fn, objs, indices());
+      });
+  }
+
+  bench::Run(prefix + "/poly", [&](size_t k) {
+      const typename H::Base *objs[N];
+      for (int i = 0; i < N; ++i) {
+        objs[i] = objects.poly[(k * N + i) & 1023];
+      }
+      return call(m, objs, indices());
+    });
+
+  {
+    typename type::site_type site{};
+    const typename H::Base *objs[N];
+    for (int i = 0; i < N; ++i) objs[i] = &objects.leaf;
+    bench::Run("site/" + hierarchy + "/" + std::to_string(N) + "/mono",
+               [&](size_t) {
+                 return call_site(m, site, objs, indices());
+               });
+  }
+
+  std::unique_ptr<type> cold;
+  const typename H::Base *objs[N];
+  for (int i = 0; i < N; ++i) objs[i] = &objects.leaf;
+  bench::RunOnce(prefix + "/cold",
+                 [&](int) {
+                   cold.reset(new type);
+                   method::Init(*cold);
+                 },
+                 [&](int) {
+                   return call(*cold, objs, indices());
+                 });
+}
+
+// Hand written dispatch over Single, the same overloads as Method<Single, 2>.
+int dynamic_cast_add(const single_h::Base &a, const single_h::Base &b) {
+  using namespace single_h;
+  auto al = dynamic_cast<const Leaf*>(&a);
+  auto bl = dynamic_cast<const Leaf*>(&b);
+  if (al && bl) return overload(*al, *bl);
+  auto am = dynamic_cast<const Mid*>(&a);
+  auto bm = dynamic_cast<const Mid*>(&b);
+  if (am && bm) return overload(*am, *bm);
+  return overload(a, b);
+}
+
+// Double dispatch with a visitor, the second call resolves statically.
+namespace visitor_h {
+struct Mid;
+struct Leaf;
+
+struct Base {
+  virtual ~Base() {}
+  virtual int dispatch(const Base &b) const { return b.with_first(*this); }
+  virtual int with_first(const Base &a) const;
+  virtual int with_first(const Mid &a) const;
+  virtual int with_first(const Leaf &a) const;
+  int value = 1;
+};
+struct Mid : Base {
+  int dispatch(const Base &b) const override { return b.with_first(*this); }
+  int with_first(const Base &a) const override;
+  int with_first(const Mid &a) const override;
+  int with_first(const Leaf &a) const override;
+};
+struct Leaf : Mid {
+  int dispatch(const Base &b) const override { return b.with_first(*this); }
+  int with_first(const Base &a) const override;
+  int with_first(const Mid &a) const override;
+  int with_first(const Leaf &a) const override;
+};
+
+int Base::with_first(const Base &a) const { return overload(a, *this); }
+int Base::with_first(const Mid &a) const { return overload<Base, Base>(a, *this); }
+int Base::with_first(const Leaf &a) const { return overload<Base, Base>(a, *this); }
+int Mid::with_first(const Base &a) const { return overload<Base, Base>(a, *this); }
+int Mid::with_first(const Mid &a) const { return overload(a, *this); }
+int Mid::with_first(const Leaf &a) const { return overload<Mid, Mid>(a, *this); }
+int Leaf::with_first(const Base &a) const { return overload<Base, Base>(a, *this); }
+int Leaf::with_first(const Mid &a) const { return overload<Mid, Mid>(a, *this); }
+int Leaf::with_first(const Leaf &a) const { return overload(a, *this); }
+}  // namespace visitor_h
+
+void bench_baselines() {
+  Objects<Single> objects;
+  const single_h::Base *leaf = &objects.leaf;
+  bench::Run("virtual/single/1/mono", [&](size_t) {
+      return bench::opaque(leaf)->id();
+    });
+  bench::Run("virtual/single/1/poly", [&](size_t k) {
+      return objects.poly[k & 1023]->id();
+    });
+  bench::Run("dynamic_cast/single/2/mono", [&](size_t) {
+      return dynamic_cast_add(*bench::opaque(leaf), *bench::opaque(leaf));
+    });
+  bench::Run("dynamic_cast/single/2/poly", [&](size_t k) {
+      return dynamic_cast_add(*objects.poly[(k * 2) & 1023],
+                              *objects.poly[(k * 2 + 1) & 1023]);
+    });
+
+  visitor_h::Base vb;
+  visitor_h::Mid vm;
+  visitor_h::Leaf vl;
+  const visitor_h::Base *all[] = {&vb, &vm, &vl};
+  std::vector<const visitor_h::Base*> vpoly;
+  for (auto p : objects.poly) {
+    vpoly.push_back(all[p->id()]);
+  }
+  bench::Run("visitor/single/2/mono", [&](size_t) {
+      const visitor_h::Base *p = bench::opaque(&vl);
+      return p->dispatch(*p);
+    });
+  bench::Run("visitor/single/2/poly", [&](size_t k) {
+      return vpoly[(k * 2) & 1023]->dispatch(*vpoly[(k * 2 + 1) & 1023]);
+    });
+}
+
+// The other front-ends of a MultiMethod<2>, over the diamond.
+void bench_backends() {
+  using namespace diamond_h;
+  typedef int (*func_type)(void*, void*);
+  Objects<Diamond> objects;
+  mm::MultiMethod<2> m;
+  m.Add<Base, Base>(overload<Base, Base>);
+  m.Add<Mid, Mid>(overload<Mid, Mid>);
+  m.Add<Leaf, Leaf>(overload<Leaf, Leaf>);
+  const Base &leaf = objects.leaf;
+
+  bench::Run("raw/diamond/2/mono", [&](size_t) {
+      std::array<void*, 2> ptrs;
+      auto fp = m.Find(ptrs, leaf, leaf);
+      return reinterpret_cast<func_type>(fp)(ptrs[0], ptrs[1]);
+    });
+  bench::Run("raw/diamond/2/poly", [&](size_t k) {
+      std::array<void*, 2> ptrs;
+      auto fp = m.Find(ptrs, *objects.poly[(k * 2) & 1023],
+                       *objects.poly[(k * 2 + 1) & 1023]);
+      return reinterpret_cast<func_type>(fp)(ptrs[0], ptrs[1]);
+    });
+
+  {
+    const Final final_leaf{};
+    bench::Run("raw/diamond/2/final", [&](size_t) {
+        std::array<void*, 2> ptrs;
+        auto &f = *bench::opaque(&final_leaf);
+        auto fp = m.Find(ptrs, f, f);
+        return reinterpret_cast<func_type>(fp)(ptrs[0], ptrs[1]);
+      });
+  }
+
+  {
+    mm::DispatchSite<mm::MultiMethod<2>> site{};
+    bench::Run("site/diamond/2/poly", [&](size_t k) {
+        std::array<void*, 2> ptrs;
+        auto fp = site.Find(m, ptrs, *objects.poly[(k * 2) & 1023],
+                            *objects.poly[(k * 2 + 1) & 1023]);
+        return reinterpret_cast<func_type>(fp)(ptrs[0], ptrs[1]);
+      });
+  }
+
+  {
+    mm::DispatchMatrix<2, mm::void_func> matrix;
+    bench::Run("matrix/diamond/2/poly", [&](size_t k) {
+        std::array<void*, 2> ptrs;
+        auto fp = matrix.Find(m, ptrs, *objects.poly[(k * 2) & 1023],
+                              *objects.poly[(k * 2 + 1) & 1023]);
+        return reinterpret_cast<func_type>(fp)(ptrs[0], ptrs[1]);
+      });
+  }
+
+  {
+    const size_t n = 1024;
+    std::vector<const Base*> as, bs;
+    for (size_t k = 0; k < n; ++k) {
+      as.push_back(objects.poly[(k * 2) & 1023]);
+      bs.push_back(objects.poly[(k * 2 + 1) & 1023]);
+    }
+    bench::Run("batch/diamond/2/poly", [&](size_t) {
+        int64_t sum = 0;
+        m.DispatchBatch(n, [&](mm::void_func fp,
+                               const std::array<void*, 2> &ptrs, size_t) {
+            sum += reinterpret_cast<func_type>(fp)(ptrs[0], ptrs[1]);
+          }, as.data(), bs.data());
+        return sum;
+      }, 1 << 12, 64, n);
+  }
+
+  mm::MultiMethod<2> cached;
+  cached.Add<Base, Base>(overload<Base, Base>);
+  cached.Add<Mid, Mid>(overload<Mid, Mid>);
+  cached.Add<Leaf, Leaf>(overload<Leaf, Leaf>);
+  cached.EnableThreadCache();
+  bench::Run("thread_cache/diamond/2/poly", [&](size_t k) {
+      std::array<void*, 2> ptrs;
+      auto fp = cached.Find(ptrs, *objects.poly[(k * 2) & 1023],
+                            *objects.poly[(k * 2 + 1) & 1023]);
+      return reinterpret_cast<func_type>(fp)(ptrs[0], ptrs[1]);
+    });
+
+  m.Seal<Base, Mid, Leaf>();
+  bench::Run("sealed/diamond/2/poly", [&](size_t k) {
+      std::array<void*, 2> ptrs;
+      auto fp = m.Find(ptrs, *objects.poly[(k * 2) & 1023],
+                       *objects.poly[(k * 2 + 1) & 1023]);
+      return reinterpret_cast<func_type>(fp)(ptrs[0], ptrs[1]);
+    });
+
+  typedef mm::StaticMultiMethod<
+      int(mm::virtual_<const Base&>, mm::virtual_<const Base&>),
+      mm::type_list<Base, Mid, Leaf>,
+      MULTI_METHOD_OVERLOAD(overload<Base, Base>),
+      MULTI_METHOD_OVERLOAD(overload<Mid, Mid>),
+      MULTI_METHOD_OVERLOAD(overload<Leaf, Leaf>)> static_method;
+  bench::Run("static/diamond/2/mono", [&](size_t) {
+      return static_method::Call(*bench::opaque(&leaf), leaf);
+    });
+  bench::Run("static/diamond/2/poly", [&](size_t k) {
+      return static_method::Call(*objects.poly[(k * 2) & 1023],
+                                 *objects.poly[(k * 2 + 1) & 1023]);
+    });
+}
+
+// The same three levels as values in a tagged union, no vtable.
+namespace tagged_h {
+struct Base {
+  int value;
+};
+struct Mid : Base {};
+struct Leaf : Mid {};
+
+struct Value {
+  typedef mm::type_list<Base, Mid, Leaf> alternatives;
+  int kind;
+  Leaf leaf;
+
+  int index() const {
+    return kind;
+  }
+
+  template <int I>
+  const typename mm::type_at<I, alternatives>::type &get() const {
+    return leaf;
+  }
+};
+
+template <class A, class B>
+int overload(const A &a, const B &b) {
+  return a.value + b.value * 2;
+}
+}  // namespace tagged_h
+
+void bench_tagged() {
+  using namespace tagged_h;
+  mm::TaggedMultiMethod<int(mm::virtual_<const Value&>,
+                            mm::virtual_<const Value&>)> m;
+  m.Add(tagged_h::overload<Base, Base>);
+  m.Add(tagged_h::overload<Mid, Mid>);
+  m.Add(MULTI_METHOD_FN(tagged_h::overload<Leaf, Leaf>));
+  std::vector<Value> poly(1024);
+  for (size_t k = 0; k < poly.size(); ++k) {
+    poly[k].kind = (k * 7919) % 3;
+    poly[k].leaf.value = k;
+  }
+  const Value *leaf = &poly[1];
+  bench::Run("tagged/single/2/mono", [&](size_t) {
+      auto v = bench::opaque(leaf);
+      return m(*v, *v);
+    });
+  bench::Run("tagged/single/2/poly", [&](size_t k) {
+      return m(poly[(k * 2) & 1023], poly[(k * 2 + 1) & 1023]);
+    });
+}
+
+template <class H>
+void bench_hierarchy(const std::string &name) {
+  bench_arity<H, 1>(name);
+  bench_arity<H, 2>(name);
+  bench_arity<H, 3>(name);
+  bench_arity<H, 4>(name);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) bench::filter = argv[1];
+  bench::Header();
+  bench_baselines();
+  bench_hierarchy<Single>("single");
+  bench_hierarchy<Virtual>("virtual");
+  bench_hierarchy<Diamond>("diamond");
+  bench_backends();
+  bench_tagged();
+  return 0;
+}
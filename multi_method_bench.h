@@ -0,0 +1,186 @@
+#ifndef FILE_3BBC20F4_EFA5_4698_9A1D_FD9D4AD6CFD7_H
+#define FILE_3BBC20F4_EFA5_4698_9A1D_FD9D4AD6CFD7_H
+// Helpers of the benchmarks: timing in batches for percentiles, and hardware
+// counters with perf_event_open when the kernel lets us.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace bench {
+
+struct PerfCounters {
+  static const int kCount = 3;
+  int fds_[kCount];
+  uint64_t values_[kCount];
+
+  PerfCounters() {
+    for (int i = 0; i < kCount; ++i) {
+      fds_[i] = -1;
+      values_[i] = 0;
+    }
+#ifdef __linux__
+    fds_[0] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (fds_[0] < 0) return;
+    fds_[1] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, fds_[0]);
+    fds_[2] = Open(PERF_TYPE_HW_CACHE,
+                   PERF_COUNT_HW_CACHE_L1D |
+                   (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                   fds_[0]);
+#endif
+  }
+
+  ~PerfCounters() {
+#ifdef __linux__
+    for (int i = 0; i < kCount; ++i) {
+      if (fds_[i] >= 0) close(fds_[i]);
+    }
+#endif
+  }
+
+  bool ok() const {
+    return fds_[0] >= 0;
+  }
+
+  void Start() {
+#ifdef __linux__
+    if (!ok()) return;
+    ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+  }
+
+  void Stop() {
+#ifdef __linux__
+    if (!ok()) return;
+    ioctl(fds_[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    for (int i = 0; i < kCount; ++i) {
+      uint64_t v = 0;
+      if (fds_[i] >= 0 && read(fds_[i], &v, sizeof(v)) == sizeof(v)) {
+        values_[i] += v;
+      }
+    }
+#endif
+  }
+
+ private:
+#ifdef __linux__
+  static int Open(uint32_t type, uint64_t config, int group) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+  }
+#endif
+};
+
+// Keeps the results alive.
+static volatile int64_t sink;
+
+static std::string filter;
+
+// Hides where p points to, so the compiler can't devirtualize through it.
+template <class T>
+inline T *opaque(T *p) {
+  asm volatile("" : "+r"(p));
+  return p;
+}
+
+inline bool Selected(const std::string &name) {
+  return filter.empty() || name.find(filter) != std::string::npos;
+}
+
+inline void Header() {
+  printf("%-36s %9s %9s %9s %9s %9s %9s\n", "name", "p50 ns", "p90 ns",
+         "p99 ns", "cycles", "br-miss", "L1-miss");
+}
+
+inline void Report(const std::string &name, std::vector<double> ns,
+                   const PerfCounters &perf, double calls) {
+  std::sort(ns.begin(), ns.end());
+  auto at = [&](double q) {
+    return ns[std::min(ns.size() - 1, (size_t)(q * ns.size()))];
+  };
+  printf("%-36s %9.2f %9.2f %9.2f", name.c_str(), at(0.5), at(0.9), at(0.99));
+  if (perf.ok()) {
+    for (int i = 0; i < PerfCounters::kCount; ++i) {
+      if (perf.fds_[i] >= 0) {
+        printf(" %9.2f", perf.values_[i] / calls);
+      } else {
+        printf(" %9s", "n/a");
+      }
+    }
+  } else {
+    printf(" %9s %9s %9s", "n/a", "n/a", "n/a");
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+// Calls func(i) in batches, the percentiles are over the ns/call of the
+// batches, the counters per call. A func doing several calls gives their
+// number in work.
+template <class Func>
+void Run(const std::string &name, const Func &func,
+         size_t calls = 1 << 22, int batches = 64, size_t work = 1) {
+  if (!Selected(name)) return;
+  size_t per = calls / batches;
+  int64_t sum = 0;
+  for (size_t i = 0; i < per; ++i) sum += func(i);
+  PerfCounters perf;
+  std::vector<double> ns;
+  for (int b = 0; b < batches; ++b) {
+    perf.Start();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < per; ++i) sum += func(i);
+    auto end = std::chrono::steady_clock::now();
+    perf.Stop();
+    std::chrono::duration<double, std::nano> elapsed = end - start;
+    ns.push_back(elapsed.count() / per / work);
+  }
+  sink = sum;
+  Report(name, ns, perf, (double)per * batches * work);
+}
+
+// Times func(i) alone, setup(i) isn't counted, for costs paid once, like the
+// first call.
+template <class Setup, class Func>
+void RunOnce(const std::string &name, const Setup &setup, const Func &func,
+             int samples = 1000) {
+  if (!Selected(name)) return;
+  int64_t sum = 0;
+  PerfCounters perf;
+  std::vector<double> ns;
+  for (int s = 0; s < samples; ++s) {
+    setup(s);
+    perf.Start();
+    auto start = std::chrono::steady_clock::now();
+    sum += func(s);
+    auto end = std::chrono::steady_clock::now();
+    perf.Stop();
+    std::chrono::duration<double, std::nano> elapsed = end - start;
+    ns.push_back(elapsed.count());
+  }
+  sink = sum;
+  Report(name, ns, perf, samples);
+}
+
+}  // namespace bench
+#endif // FILE_3BBC20F4_EFA5_4698_9A1D_FD9D4AD6CFD7_H
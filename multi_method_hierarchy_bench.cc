@@ -0,0 +1,248 @@
+// Resolution scaling over generated hierarchies, build with
+// -DCMAKE_BUILD_TYPE=Release.
+//
+//   multi_method_hierarchy_bench [filter]
+//
+// A Shape<Depth, Fanout, VirtualPercent> is a tree of classes, each one has
+// Fanout children down to Depth, and about VirtualPercent of the edges are
+// virtual. Overloads are random tuples of classes, closed so that every real
+// tuple has a unique most specific one, Resolve aborts otherwise.
+//
+// For each shape, arity and number of random overloads, it reports:
+//   cold    ns of the first Find of a tuple, which resolves it,
+//   visits  candidates visited by upcast_recursive_check<N> per tuple, the
+//           product of the ancestors the old Resolve probed one by one, to
+//           compare with the cold column of the overload based one,
+//   memory  bytes of table_ and resolved_ after the warm-up,
+//   warm    ms of all the first Finds, and of a Seal of all the classes.
+#include "multi_method/multi_method.h"
+#include "multi_method_bench.h"
+
+#include <memory>
+#include <random>
+#include <set>
+
+namespace mm = multi_method;
+
+template <int Depth, int Fanout, int VirtualPercent>
+struct Shape {
+  static const int kDepth = Depth;
+  static const int kFanout = Fanout;
+  static const int kVirtualPercent = VirtualPercent;
+
+  static constexpr bool is_virtual(int d, int i) {
+    return d > 0 && (d * 7919 + i * 104729) % 100 < VirtualPercent;
+  }
+};
+
+// The class I at depth D, its parent is I / Fanout at D - 1.
+template <class S, int D, int I, bool Virtual = S::is_virtual(D, I)>
+struct Node;
+
+template <class S>
+struct Node<S, 0, 0, false> {
+  virtual ~Node() {}
+  int value = 0;
+};
+
+template <class S, int D, int I>
+struct Node<S, D, I, false> : Node<S, D - 1, I / S::kFanout> {
+  int value = D;
+};
+
+template <class S, int D, int I>
+struct Node<S, D, I, true> : virtual Node<S, D - 1, I / S::kFanout> {
+  int value = D;
+};
+
+// An object of every class.
+template <class S>
+struct Classes {
+  typedef Node<S, 0, 0> Root;
+  std::vector<std::unique_ptr<Root>> objects;
+  std::vector<const std::type_info*> types;
+  int virtuals = 0;
+
+  template <int D, int I>
+  void Add() {
+    objects.emplace_back(new Node<S, D, I>);
+    types.push_back(&typeid(Node<S, D, I>));
+    virtuals += S::is_virtual(D, I);
+  }
+};
+
+template <class S, int D, int I, int F, bool More>
+struct Children {
+  static void Run(Classes<S> &) {}
+};
+
+template <class S, int D, int I>
+struct Build {
+  static void Run(Classes<S> &classes) {
+    classes.template Add<D, I>();
+    Children<S, D, I, 0, (D < S::kDepth)>::Run(classes);
+  }
+};
+
+template <class S, int D, int I, int F>
+struct Children<S, D, I, F, true> {
+  static void Run(Classes<S> &classes) {
+    Build<S, D + 1, I * S::kFanout + F>::Run(classes);
+    Children<S, D, I, F + 1, (F + 1 < S::kFanout)>::Run(classes);
+  }
+};
+
+int overload() {
+  return 0;
+}
+
+// The root tuple, seeds random tuples, and the most derived of each pair that
+// can apply to the same real tuple, until there's no more.
+template <int N>
+std::vector<mm::TypePartialArray<N>> MakeOverloads(
+    const std::vector<const std::type_info*> &types, int seeds,
+    std::mt19937 &rng) {
+  typedef mm::TypePartialArray<N> partial;
+  std::vector<partial> overloads;
+  auto add = [&](const partial &p) {
+    if (std::find(overloads.begin(), overloads.end(), p) == overloads.end()) {
+      overloads.push_back(p);
+    }
+  };
+  partial root;
+  for (int i = 0; i < N; ++i) root[i] = types[0];
+  add(root);
+  for (int k = 0; k < seeds; ++k) {
+    partial p;
+    for (int i = 0; i < N; ++i) p[i] = types[rng() % types.size()];
+    add(p);
+  }
+  for (size_t a = 0; a < overloads.size(); ++a) {
+    for (size_t b = 0; b < a; ++b) {
+      partial join;
+      bool comparable = true;
+      for (int i = 0; i < N && comparable; ++i) {
+        auto x = overloads[a][i], y = overloads[b][i];
+        if (x >= y) {
+          join[i] = x;
+        } else if (y >= x) {
+          join[i] = y;
+        } else {
+          comparable = false;
+        }
+      }
+      if (comparable) add(join);
+    }
+  }
+  return overloads;
+}
+
+template <class S, int N>
+void Run(const std::string &shape, const Classes<S> &classes, int seeds,
+         int samples) {
+  typedef mm::MultiMethod<N> method;
+  typedef typename method::partial partial;
+  auto name = shape + "/" + std::to_string(N) + "/" + std::to_string(seeds);
+  if (!bench::Selected(name)) return;
+  std::mt19937 rng(seeds * 31 + N);
+  auto overloads = MakeOverloads<N>(classes.types, seeds, rng);
+
+  // Distinct real tuples, by class index.
+  std::vector<std::array<int, N>> tuples;
+  std::set<std::array<int, N>> seen;
+  size_t space = 1;
+  for (int i = 0; i < N; ++i) space *= classes.types.size();
+  while ((int)tuples.size() < samples && seen.size() < space) {
+    std::array<int, N> t;
+    for (int i = 0; i < N; ++i) t[i] = rng() % classes.types.size();
+    if (seen.insert(t).second) tuples.push_back(t);
+  }
+
+  method m;
+  for (auto &p : overloads) m.Add(p, overload);
+  std::vector<double> cold;
+  double visits = 0, max_visits = 0;
+  auto warm_start = std::chrono::steady_clock::now();
+  for (auto &t : tuples) {
+    partial real;
+    std::array<void*, N> objs;
+    for (int i = 0; i < N; ++i) {
+      auto o = classes.objects[t[i]].get();
+      real[i] = &typeid(*o);
+      objs[i] = mm::get_whole(o, real[i].type_);
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto func = m.Find(real, objs);
+    auto end = std::chrono::steady_clock::now();
+    bench::sink = func != nullptr;
+    std::chrono::duration<double, std::nano> elapsed = end - start;
+    cold.push_back(elapsed.count());
+  }
+  std::chrono::duration<double, std::milli> warm =
+      std::chrono::steady_clock::now() - warm_start;
+
+  for (auto &t : tuples) {
+    partial real;
+    std::array<void*, N> objs;
+    for (int i = 0; i < N; ++i) {
+      auto o = classes.objects[t[i]].get();
+      real[i] = &typeid(*o);
+      objs[i] = mm::get_whole(o, real[i].type_);
+    }
+    double n = 0;
+    mm::upcast_recursive_check<N>(
+        [&](const partial &, const std::array<void*, N> &) {
+          ++n;
+          return false;
+        },
+        real, objs);
+    visits += n;
+    max_visits = std::max(max_visits, n);
+  }
+
+  method sealed;
+  for (auto &p : overloads) sealed.Add(p, overload);
+  auto seal_start = std::chrono::steady_clock::now();
+  auto report = sealed.Seal(classes.types);
+  std::chrono::duration<double, std::milli> seal =
+      std::chrono::steady_clock::now() - seal_start;
+  if (!report.ok()) {
+    fprintf(stderr, "%s: seal found %zu ambiguous tuples\n", name.c_str(),
+            report.ambiguous.size());
+  }
+
+  std::sort(cold.begin(), cold.end());
+  printf("%-20s %7zu %6zu %6zu %9.0f %9.0f %7.1f %7.0f %9zu %9zu %8.2f "
+         "%8.2f %9zu\n",
+         name.c_str(), classes.types.size(), overloads.size(), tuples.size(),
+         cold[cold.size() / 2], cold[cold.size() * 99 / 100],
+         visits / tuples.size(), max_visits, m.table_.bytes(),
+         m.resolved_.bytes(), warm.count(), seal.count(),
+         sealed.sealed_.size());
+  fflush(stdout);
+}
+
+template <class S>
+void Shapes(const std::string &shape) {
+  Classes<S> classes;
+  Build<S, 0, 0>::Run(classes);
+  for (int seeds : {4, 16, 64}) {
+    Run<S, 2>(shape, classes, seeds, 4000);
+    Run<S, 3>(shape, classes, seeds, 4000);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) bench::filter = argv[1];
+  printf("%-20s %7s %6s %6s %9s %9s %7s %7s %9s %9s %8s %8s %9s\n",
+         "shape/arity/seeds", "classes", "funcs", "tuples", "cold p50",
+         "cold p99", "visits", "max", "table", "resolved", "warm ms",
+         "seal ms", "cells");
+  Shapes<Shape<2, 4, 0>>("d2f4v0");
+  Shapes<Shape<3, 4, 0>>("d3f4v0");
+  Shapes<Shape<4, 4, 0>>("d4f4v0");
+  Shapes<Shape<4, 4, 50>>("d4f4v50");
+  Shapes<Shape<6, 2, 50>>("d6f2v50");
+  Shapes<Shape<3, 8, 25>>("d3f8v25");
+  return 0;
+}
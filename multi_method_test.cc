@@ -1,7 +1,18 @@
 #include "multi_method/multi_method.h"
-
+#include "multi_method/matrix.h"
+#include "multi_method/site.h"
+#include "multi_method/profile.h"
+#include "multi_method/snapshot.h"
+#include "multi_method/static.h"
+#include "multi_method/tagged.h"
+#include "multi_method/typed.h"
+
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <thread>
+#include <vector>
 
 namespace mm = multi_method;
 
@@ -39,6 +50,10 @@ struct D : virtual B, virtual C {
   int value = __LINE__;
 };
 
+struct F final : D {
+  int value = __LINE__;
+};
+
 mm::MultiMethod<1> mm_bench;
 
 template <class T>
@@ -49,11 +64,25 @@ void bench(const T& v) {
   func(ptr[0]);
 }
 
+template <class T>
+void bench_site(const T& v) {
+  static thread_local mm::DispatchSite<decltype(mm_bench)> site;
+  std::array<void*, 1> ptr;
+  auto fp = site.Find(mm_bench, ptr, v);
+  auto func = reinterpret_cast<void (*)(void*)>(fp);
+  func(ptr[0]);
+}
+
 template <class T>
 void bench_static(const T &v) { }
 
+// Calls per test_func, the first argument overrides it, ctest runs a smoke
+// count, see multi_method_bench for the numbers.
+int test_calls = 1.e8;
+
 template <class Func>
-void test_func(const std::string & name, const Func & func, int N=1.e8) {
+void test_func(const std::string & name, const Func & func,
+               int N=test_calls) {
   auto start = std::chrono::steady_clock::now();
   for (int i = 0; i < N; ++i) {
     func(i);
@@ -74,13 +103,135 @@ int add(const A& a, const B & b) {
   return func(ptr[0], ptr[1]);
 }
 
+template <class A, class B>
+int add_site(const A& a, const B & b) {
+  static thread_local mm::DispatchSite<decltype(mm_add), 2> site;
+  std::array<void*, 2> ptr;
+  auto fp = site.Find(mm_add, ptr, a, b);
+  auto func = reinterpret_cast<int(*)(void*, void*)>(fp);
+  return func(ptr[0], ptr[1]);
+}
+
+mm::DispatchMatrix<2, mm::void_func> add_matrix;
+
+template <class A, class B>
+int add_matrix_find(const A& a, const B & b) {
+  std::array<void*, 2> ptr;
+  auto fp = add_matrix.Find(mm_add, ptr, a, b);
+  auto func = reinterpret_cast<int(*)(void*, void*)>(fp);
+  return func(ptr[0], ptr[1]);
+}
+
 template <class A, class B>
 int add_static(const A &a, const B & b) {
   return a.value + b.value;
 }
 
+// Gets the whole objects.
+int add_fallback(void *, void *) {
+  return -2;
+}
+
+// A tagged value, no virtual function.
+struct Circle {
+  int r;
+};
+struct Polygon {
+  int sides;
+};
+struct Square : Polygon {
+  int side;
+};
+struct Triangle : Polygon {
+  int base;
+};
+
+struct Shape {
+  typedef mm::type_list<Circle, Square, Triangle> alternatives;
+  int kind;
+  union {
+    Circle circle;
+    Square square;
+    Triangle triangle;
+  };
+
+  int index() const {
+    return kind;
+  }
+
+  template <int I>
+  const typename mm::type_at<I, alternatives>::type &get() const;
+};
+
+template <>
+const Circle &Shape::get<0>() const {
+  return circle;
+}
+
+template <>
+const Square &Shape::get<1>() const {
+  return square;
+}
+
+template <>
+const Triangle &Shape::get<2>() const {
+  return triangle;
+}
+
+int meet_any(const Shape &a, const Shape &b, int k) {
+  return k;
+}
+
+int meet_pp(const Polygon &a, const Polygon &b, int k) {
+  return 100 + a.sides * 10 + b.sides + k;
+}
+
+int meet_ca(const Circle &a, const Shape &b, int k) {
+  return 200 + a.r + k;
+}
+
+int meet_ss(const Square &a, const Square &b, int k) {
+  return 300 + a.side + b.side + k;
+}
+
+int meet_ac(const Shape &a, const Circle &b, int k) {
+  return 400 + b.r + k;
+}
+
+template <class A, class B>
+int add_extra(const A &a, const B *b, int x) {
+  return a.value + b->value + x;
+}
+
+mm::TypedMultiMethod<int(mm::virtual_<const V&>, mm::virtual_<const V*>, int)>
+typed_add;
+
 mm::MultiMethod<2> mm_mat_add;
 
+// A is ambiguous in SealX, and private in SealP.
+struct SealZ {
+  virtual ~SealZ() {}
+  int value = 11;
+};
+
+struct SealA {
+  virtual ~SealA() {}
+  int value = 42;
+};
+
+struct SealL : SealA {};
+struct SealR : SealA {};
+struct SealX : SealZ, SealL, SealR {};
+struct SealP : SealZ, private SealA {};
+
+int seal_a(const SealA &a) {
+  return a.value;
+}
+
+int seal_z(const SealZ &z) {
+  return z.value;
+}
+
 struct Matrix {
   virtual ~Matrix() {}
 };
@@ -107,7 +258,7 @@ Matrix* mat_add_dd(const Diagonal &, const Diagonal &) {
   return new Diagonal();
 }
 
-static int mm_mat_init__ = [&]() {
+static int mm_mat_init__ = []() {
   mm_mat_add.Add<Matrix, Matrix>(&mat_add_mm);
   mm_mat_add.Add<Matrix, Diagonal>(&mat_add_md);
   mm_mat_add.Add<Diagonal, Matrix>(&mat_add_dm);
@@ -123,7 +274,67 @@ std::unique_ptr<Matrix> mat_add(const A &a, const B &b) {
   return std::unique_ptr<Matrix>{func(ptrs[0], ptrs[1])};
 }
 
+// Readers racing with an Add that resizes, and so retires, the states.
+void test_table_threads() {
+  mm::Table<intptr_t, intptr_t> table;
+  const intptr_t n = 20000;
+  std::atomic<bool> done{false};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&]() {
+        while (!done.load()) {
+          for (intptr_t k = 1; k <= n; k += 97) {
+            auto v = table.Find(k);
+            assert(v == 0 || v == k * 2);
+          }
+        }
+      });
+  }
+  for (intptr_t k = 1; k <= n; ++k) {
+    table.Add(k, k * 2);
+  }
+  done = true;
+  for (auto &r : readers) r.join();
+  for (intptr_t k = 1; k <= n; ++k) {
+    assert(table.Find(k) == k * 2);
+  }
+  mm::Epoch::Instance().Reclaim();
+  std::cerr << "retired states = " << mm::Epoch::Instance().retired()
+            << std::endl;
+}
+
+// Writers adding the same keys at once, through the resizes, each key is
+// added by exactly one of them.
+void test_table_writers() {
+  mm::Table<intptr_t, intptr_t> table;
+  const intptr_t n = 20000;
+  std::atomic<int> added{0};
+  std::vector<std::thread> writers;
+  for (int t = 0; t < 4; ++t) {
+    writers.emplace_back([&, t]() {
+        for (intptr_t i = 0; i < n; ++i) {
+          intptr_t k = (i * 7 + t * 1237) % n + 1;
+          auto r = table.Add(k, k * 2);
+          assert(r.first == k * 2);
+          added += r.second;
+        }
+      });
+  }
+  for (auto &w : writers) w.join();
+  assert(added == n && table.size() == (size_t)n);
+  size_t count = 0;
+  table.foreach([&](intptr_t k, intptr_t v) {
+      assert(v == k * 2);
+      ++count;
+    });
+  assert(count == (size_t)n);
+}
+
 int main(int argc, char* argv[]) {
+  if (argc > 1) test_calls = atoi(argv[1]);
+  test_table_threads();
+  test_table_writers();
+
   {
     Matrix m; Diagonal d;
     mat_add((Matrix&)m, (Matrix&)m);
@@ -132,6 +343,47 @@ int main(int argc, char* argv[]) {
     mat_add((Matrix&)d, (Matrix&)d);
   }
 
+  {
+    auto report = mm_mat_add.Seal<Matrix, Diagonal>();
+    assert(report.ok());
+    Matrix m; Diagonal d;
+    mat_add((Matrix&)d, (Matrix&)m);
+    mat_add((Matrix&)d, (Matrix&)d);
+  }
+
+  {
+    mm::MultiMethod<1> mm_sealed;
+    mm_sealed.Add<B>(bench_static<B>);
+    mm_sealed.Add<C>(bench_static<C>);
+    auto report = mm_sealed.Seal<V, B, C, D>();
+    assert(report.ambiguous.size() == 1);
+    assert(report.ambiguous[0][0].type_ == &typeid(D));
+    assert(report.missing.size() == 1);
+    assert(report.missing[0][0].type_ == &typeid(V));
+    C c;
+    std::array<void*, 1> ptr;
+    assert(mm_sealed.Find(ptr, c) ==
+           reinterpret_cast<mm::void_func>(bench_static<C>));
+    assert(ptr[0] == (const C*)&c);
+  }
+
+  {
+    mm::MultiMethod<1> mm_sealed;
+    mm_sealed.SetErrorPolicy(mm::ErrorPolicy::kErrorCode);
+    mm_sealed.Add<SealA>(seal_a);
+    auto report = mm_sealed.Seal<SealX, SealP, SealL>();
+    assert(!report.ok() && report.missing.size() == 1);
+    SealX x;
+    SealP p;
+    SealL l;
+    std::array<void*, 1> ptr;
+    assert(!mm_sealed.Find(ptr, (const SealZ&)x));
+    assert(!mm_sealed.Find(ptr, (const SealZ&)p));
+    assert(mm_sealed.Find(ptr, l) ==
+           reinterpret_cast<mm::void_func>(seal_a));
+    assert(((const SealA*)ptr[0])->value == 42);
+  }
+
   mm_show.Add<V>(show_static<V>);
   mm_show.Add<B>(show_static<B>);
   // mm_show.Add<C>(show_static<C>);
@@ -159,6 +411,553 @@ int main(int argc, char* argv[]) {
   std::cerr << "V+B = " << add(V{}, B{}) << std::endl;
   std::cerr << "B+B = " << add(B{}, B{}) << std::endl;
 
+  typed_add.Add(add_extra<V, V>);
+  typed_add.Add<B, B>(add_extra<B, B>);
+  typed_add.Add(MULTI_METHOD_FN(add_extra<D, V>));
+  typed_add.Add<D, B>(MULTI_METHOD_FN(add_extra<D, B>));
+
+  {
+    V v; B b; C c; D d;
+    assert(typed_add(v, &v, 1) == v.value + v.value + 1);
+    assert(typed_add(b, &b, 2) == b.B::value + b.B::value + 2);
+    assert(typed_add(c, &b, 3) == c.V::value + b.V::value + 3);
+    assert(typed_add(d, &v, 4) == d.D::value + v.value + 4);
+    assert(typed_add(d, &d, 5) == d.D::value + d.B::value + 5);
+    assert(typed_add(d, &c, 6) == d.D::value + c.V::value + 6);
+    std::cerr << "typed D+B = " << typed_add(d, &b, 0) << std::endl;
+
+    decltype(typed_add)::site_type site{};
+    for (int i = 0; i < 3; ++i) {
+      assert(typed_add.Call(site, d, &b, i) == typed_add(d, &b, i));
+      assert(typed_add.Call(site, v, &v, i) == typed_add(v, &v, i));
+      assert(typed_add.Call(site, b, &b, i) == typed_add(b, &b, i));
+      assert(typed_add.Call(site, c, &b, i) == typed_add(c, &b, i));
+      assert(typed_add.Call(site, d, &c, i) == typed_add(d, &c, i));
+    }
+  }
+
+  {
+    // (B, C) is ambiguous between (B, V) and (V, C).
+    mm::TypedMultiMethod<int(mm::virtual_<const V&>, mm::virtual_<const V*>,
+                             int)> typed;
+    typed.Add<V, V>(add_extra<V, V>);
+    typed.Add<B, V>(add_extra<B, V>);
+    typed.Add<V, C>(add_extra<V, C>);
+    B b; C c; V v;
+    typed.SetErrorPolicy(mm::ErrorPolicy::kErrorCode);
+    assert(typed(b, &c, 1) == 0);
+    typed.SetErrorPolicy(mm::ErrorPolicy::kFallback,
+                         [](const V &, const V *, int x) { return -x; });
+    assert(typed(b, &c, 7) == -7);
+    assert(typed(v, &v, 1) == v.value * 2 + 1);
+    typed.SetErrorPolicy(mm::ErrorPolicy::kThrow);
+    bool thrown = false;
+    try {
+      typed(b, &c, 1);
+    } catch (const mm::DispatchError &) {
+      thrown = true;
+    }
+    assert(thrown);
+  }
+
+  {
+    // More tuples than entries, the site keeps evicting.
+    V v; B b; C c; D d;
+    const V *all[] = {&v, &b, &c, &d};
+    for (auto x : all) {
+      for (auto y : all) {
+        assert(add_site(*x, *y) == add(*x, *y));
+      }
+    }
+    add_matrix.Register(mm_add.table_, {&typeid(V), &typeid(C)});
+    for (auto x : all) {
+      for (auto y : all) {
+        assert(add_matrix_find(*x, *y) == add(*x, *y));
+        assert(add_matrix_find(*x, *y) == add(*x, *y));
+      }
+    }
+    std::cerr << "add matrix cells = " << add_matrix.size() << std::endl;
+  }
+
+  {
+    // V is shared, so it's there once.
+    D d;
+    auto &layout = mm::Bases(&typeid(D)).layout(&d);
+    assert(layout.subobjects_.size() == 4);
+    for (auto &o : layout.subobjects_) {
+      assert(mm::Bases(&typeid(D)).upcast(&d, o.type_) ==
+             (const char*)&d + o.offset_);
+    }
+    assert(mm::Bases(&typeid(D)).upcast(&d, &typeid(V)) == (const V*)&d);
+    assert(mm::Bases(&typeid(D)).upcast(&d, &typeid(C)) == (const C*)&d);
+    int found = 0;
+    assert(!mm::Bases(&typeid(D)).find_recursive(
+        [&](const std::type_info *) { return ++found, false; }));
+    assert(found == 4);
+    assert(mm::Bases(&typeid(B)).find_recursive(
+        [](const std::type_info *t) { return t == &typeid(V); }));
+    B b;
+    int visits = 0;
+    mm::upcast_recursive_check<2>(
+        [&](const mm::TypePartialArray<2> &, const std::array<void*, 2> &) {
+          return ++visits, false;
+        },
+        {&typeid(D), &typeid(B)}, {(void*)&d, (void*)&b});
+    assert(visits == 8);
+
+    assert(mm::IsSubtype(&typeid(D), &typeid(V)));
+    assert(mm::IsSubtype(&typeid(D), &typeid(C)));
+    assert(!mm::IsSubtype(&typeid(B), &typeid(C)));
+    assert(!mm::IsSubtype(&typeid(V), &typeid(D)));
+    assert(mm::TypePartial(&typeid(D)) > mm::TypePartial(&typeid(B)));
+    assert(!(mm::TypePartial(&typeid(Matrix)) >= mm::TypePartial(&typeid(V))));
+
+    mm::TableHash<mm::TypePartialArray<2>> hash;
+    assert(hash({&typeid(B), &typeid(C)}) != hash({&typeid(C), &typeid(B)}));
+  }
+
+  {
+    // Same overloads as mm_add, through the thread caches.
+    mm::MultiMethod<2> mm_cached;
+    mm_add.table_.foreach([&](const mm::TypePartialArray<2> &p,
+                              mm::void_func f) {
+        mm_cached.Add(p, f);
+      });
+    mm_cached.EnableThreadCache();
+    auto check = [&]() {
+      V v; B b; C c; D d;
+      const V *all[] = {&v, &b, &c, &d};
+      for (int r = 0; r < 100; ++r) {
+        for (auto x : all) {
+          for (auto y : all) {
+            std::array<void*, 2> ptr;
+            auto fp = mm_cached.Find(ptr, *x, *y);
+            auto func = reinterpret_cast<int(*)(void*, void*)>(fp);
+            assert(func(ptr[0], ptr[1]) == add(*x, *y));
+          }
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) threads.emplace_back(check);
+    for (auto &t : threads) t.join();
+  }
+
+  {
+    V v; B b; C c; D d;
+    const V *all[] = {&v, &b, &c, &d};
+    const size_t n = 1000;
+    std::vector<const V*> as, bs;
+    for (size_t k = 0; k < n; ++k) {
+      as.push_back(all[k % 4]);
+      bs.push_back(all[k / 4 % 4]);
+    }
+    std::vector<int> results(n);
+    const mm::void_func *last = nullptr;
+    int switches = 0;
+    mm_add.DispatchBatch(
+        n,
+        [&](const mm::void_func &fp, const std::array<void*, 2> &ptr,
+            size_t k) {
+          auto func = reinterpret_cast<int(*)(void*, void*)>(fp);
+          results[k] = func(ptr[0], ptr[1]);
+          if (!last || *last != fp) ++switches;
+          last = &fp;
+        },
+        as.data(), bs.data());
+    for (size_t k = 0; k < n; ++k) {
+      assert(results[k] == add(*as[k], *bs[k]));
+    }
+    // Grouped by type tuple, so at most one switch per tuple.
+    assert(switches <= 16);
+  }
+
+  {
+    // Profile of the calls, and the code calling the hot tuples directly.
+    mm::MultiMethod<2> m;
+    m.Add<V, V>(add_static<V, V>);
+    m.Add<B, B>(add_static<B, B>);
+    D d;
+    B b;
+    C c;
+    // (b, b) through a site, counted on its misses and its hits.
+    mm::DispatchSite<decltype(m)> site{};
+    m.EnableProfile();
+    for (int i = 0; i < 10; ++i) {
+      std::array<void*, 2> ptr;
+      m.Find(ptr, (const V&)d, (const V&)b);
+      if (i % 2) site.Find(m, ptr, (const V&)b, (const V&)b);
+      if (i == 0) m.Find(ptr, (const V&)c, (const V&)d);
+    }
+    m.EnableProfile(false);
+    auto profile = m.Profile();
+    assert(profile.size() == 3 && profile[0].second == 10 &&
+           profile[1].second == 5 && profile[2].second == 1);
+    auto names = [](const mm::TypePartialArray<2> &pos, mm::void_func f) {
+      return f == (mm::void_func)add_static<B, B> ? "add_static<B, B>" : "";
+    };
+    auto code = mm::GenerateDispatch(m, "add_hot", 2, names);
+    assert(code.find("t0 == &typeid(D) &&\n      t1 == &typeid(B)") !=
+           std::string::npos);
+    assert(code.find("return add_static<B, B>(\n"
+                     "        ::multi_method::hot_cast<D, B>(a0),") !=
+           std::string::npos);
+    assert(code.find("no overload to call") == std::string::npos);
+    assert(code.find("2 tuples of 3, 93.8% of 16 calls") != std::string::npos);
+    // What the generated code does with the arguments.
+    const V &dv = d;
+    assert((&mm::hot_cast<D, B>(dv) == (const B*)&d));
+    assert((&mm::hot_cast<B, B>((const V&)b) == &b));
+  }
+
+  {
+    // Resolved at compile time, same choices as a MultiMethod. More classes
+    // than kScan, so their index comes from the map.
+    typedef mm::StaticMultiMethod<
+        int(mm::virtual_<const V&>, mm::virtual_<const V&>),
+        mm::type_list<V, B, C, D, F>,
+        MULTI_METHOD_OVERLOAD(add_static<V, V>),
+        MULTI_METHOD_OVERLOAD(add_static<B, V>),
+        MULTI_METHOD_OVERLOAD(add_static<B, B>)> static_add;
+    mm::MultiMethod<2> m;
+    m.Add<V, V>(add_static<V, V>);
+    m.Add<B, V>(add_static<B, V>);
+    m.Add<B, B>(add_static<B, B>);
+    V v; B b; C c; D d; F f;
+    const V *all[] = {&v, &b, &c, &d, &f};
+    for (auto x : all) {
+      for (auto y : all) {
+        std::array<void*, 2> ptr;
+        auto fp = m.Find(ptr, *x, *y);
+        auto func = reinterpret_cast<int(*)(void*, void*)>(fp);
+        assert(static_add::Call(*x, *y) == func(ptr[0], ptr[1]));
+      }
+    }
+    assert(static_add()(d, c) == ((const B&)d).value + ((const V&)c).value);
+  }
+
+  {
+    // SealA is not a usable base of SealX nor SealP, so seal_a doesn't apply.
+    typedef mm::StaticMultiMethod<
+        int(mm::virtual_<const SealZ&>),
+        mm::type_list<SealZ, SealX, SealP>,
+        MULTI_METHOD_OVERLOAD(seal_z),
+        MULTI_METHOD_OVERLOAD(seal_a)> static_seal;
+    SealX x;
+    SealP p;
+    assert(static_seal::Call(x) == 11);
+    assert(static_seal::Call(p) == 11);
+  }
+
+  {
+    // Tagged values, from their tags to a dense table.
+    mm::TaggedMultiMethod<int(mm::virtual_<const Shape&>,
+                              mm::virtual_<const Shape&>, int)> meet;
+    Shape c, s, t;
+    c.kind = 0;
+    c.circle.r = 5;
+    s.kind = 1;
+    s.square.sides = 4;
+    s.square.side = 2;
+    t.kind = 2;
+    t.triangle.sides = 3;
+    t.triangle.base = 7;
+    assert(!meet.Find(c, s).func);
+    meet.Add(meet_any);
+    meet.Add(meet_pp);
+    meet.Add(MULTI_METHOD_FN(meet_ss));
+    assert(meet(c, s, 1) == 1 && meet(t, c, 1) == 1);
+    assert(meet(s, t, 1) == 144 && meet(t, t, 1) == 134);
+    assert(meet(s, s, 1) == 305);
+    meet.Add(meet_ca);
+    assert(meet(c, s, 1) == 206 && meet(c, c, 1) == 206);
+    // (Shape, Circle) and (Circle, Shape) both apply to (c, c).
+    meet.Add(meet_ac);
+    assert(meet(t, c, 1) == 406);
+    assert(!meet.Find(c, c).func);
+    assert(meet(s, s, 0) == 304 && meet(c, t, 0) == 205);
+  }
+
+  {
+    // A burst of threads missing the same tuple, only one resolves it.
+    mm::MultiMethod<2> m;
+    m.Add<V, V>(add_static<V, V>);
+    m.Add<B, V>(add_static<B, V>);
+    D d;
+    C c;
+    std::atomic<int> ready{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+      threads.emplace_back([&]() {
+          ++ready;
+          while (ready.load() < 8) {}
+          std::array<void*, 2> ptr;
+          auto fp = m.Find(ptr, (const V&)d, (const V&)c);
+          assert(fp == ((mm::void_func)add_static<B, V>));
+        });
+    }
+    for (auto &t : threads) t.join();
+    assert(m.resolved_.size() == 1);
+    auto stats = m.Stats();
+    assert(!stats.enabled || stats.resolutions == 1);
+  }
+
+  {
+    auto stats = mm_add.Stats();
+    std::cerr << "add stats = " << stats.to_json() << std::endl;
+    if (stats.enabled) {
+      assert(stats.resolutions > 0);
+      assert(stats.hits() > 0);
+      assert(stats.resolved.finds >= stats.resolved_hits);
+    } else {
+      assert(stats.resolutions == 0 && stats.resolved.finds == 0);
+    }
+    assert(stats.resolved.size == mm_add.resolved_.size());
+    // func and two int32 offsets, the overload is not kept, padded to 32 so
+    // an entry is in one cache line.
+    assert(sizeof(decltype(mm_add)::ResolvedMethod) == 32);
+    assert(sizeof(mm::MultiMethod<1>::ResolvedMethod) == 16);
+  }
+
+  {
+    // All final, bound once per instance, and again after an Add.
+    mm::MultiMethod<2> m1, m2;
+    m1.Add<D, D>(add_static<D, D>);
+    m2.Add<V, V>(add_static<V, V>);
+    F f;
+    auto call = [&](mm::MultiMethod<2> &m) {
+      std::array<void*, 2> ptr;
+      auto func = reinterpret_cast<int(*)(void*, void*)>(m.Find(ptr, f, f));
+      return func(ptr[0], ptr[1]);
+    };
+    const D &d = f;
+    for (int i = 0; i < 3; ++i) {
+      assert(call(m1) == d.value * 2);
+      assert(call(m2) == ((const V&)f).value * 2);
+    }
+    // Same as through the non final type, before and after an Add.
+    std::array<void*, 2> ptr;
+    auto func = reinterpret_cast<int(*)(void*, void*)>(m1.Find(ptr, f, d));
+    assert(func(ptr[0], ptr[1]) == call(m1));
+    m1.Add<F, F>(add_static<F, F>);
+    func = reinterpret_cast<int(*)(void*, void*)>(m1.Find(ptr, d, d));
+    assert(func(ptr[0], ptr[1]) == call(m1));
+    // More instances than the kBoundSlots slots, the ids are consecutive, so
+    // two pairs of them share a slot, the second of each goes through Find,
+    // and still sees its own Adds.
+    mm::MultiMethod<2> many[6];
+    for (int k = 0; k < 6; ++k) {
+      if (k % 2) {
+        many[k].Add<D, D>(add_static<D, D>);
+      } else {
+        many[k].Add<V, V>(add_static<V, V>);
+      }
+    }
+    for (int i = 0; i < 3; ++i) {
+      for (int k = 0; k < 6; ++k) {
+        assert(call(many[k]) ==
+               (k % 2 ? d.value * 2 : ((const V&)f).value * 2));
+      }
+    }
+    for (int k = 0; k < 6; ++k) {
+      many[k].Add<F, F>(add_static<F, F>);
+      assert(call(many[k]) == f.value * 2);
+    }
+  }
+
+  {
+    // (B, B) is ambiguous, (V, V) has no overload.
+    auto ambiguous = [](mm::MultiMethod<2> &m) {
+      m.Add<B, V>(add_static<B, V>);
+      m.Add<V, B>(add_static<V, B>);
+    };
+    B b;
+    V v;
+    auto call = [&](mm::MultiMethod<2> &m, const V &x, const V &y) {
+      std::array<void*, 2> ptr;
+      auto fp = m.Find(ptr, x, y);
+      if (!fp) return -1;
+      return reinterpret_cast<int(*)(void*, void*)>(fp)(ptr[0], ptr[1]);
+    };
+
+    mm::MultiMethod<2> fallback;
+    ambiguous(fallback);
+    fallback.SetErrorPolicy(mm::ErrorPolicy::kFallback, add_fallback);
+    assert(call(fallback, b, b) == -2);
+    assert(call(fallback, v, v) == -2);
+    assert(call(fallback, b, v) == b.value + v.value);
+
+    mm::MultiMethod<2> code;
+    ambiguous(code);
+    code.SetErrorPolicy(mm::ErrorPolicy::kErrorCode);
+    assert(call(code, b, b) == -1);
+    assert(call(code, v, v) == -1);
+    std::array<void*, 2> objs{{&b, &b}};
+    auto r = code.Lookup({&typeid(B), &typeid(B)}, objs);
+    assert(r.status == mm::Resolution::kAmbiguous && !r.func);
+    objs = {{&v, &v}};
+    r = code.Lookup({&typeid(V), &typeid(V)}, objs);
+    assert(r.status == mm::Resolution::kNoMatch);
+    // Failures are cached like successes.
+    assert(code.resolved_.size() == 2);
+    assert(call(code, b, b) == -1);
+    assert(code.resolved_.size() == 2);
+
+    mm::MultiMethod<2> thrown;
+    ambiguous(thrown);
+    thrown.SetErrorPolicy(mm::ErrorPolicy::kThrow);
+    for (int i = 0; i < 2; ++i) {
+      bool caught = false;
+      try {
+        call(thrown, b, b);
+      } catch (const mm::DispatchError &e) {
+        caught = e.status_ == mm::Resolution::kAmbiguous;
+        if (i == 0) std::cerr << "thrown: " << e.what() << std::endl;
+      }
+      assert(caught);
+    }
+  }
+
+  {
+    // A late Add resolves again only the tuples it applies to.
+    mm::MultiMethod<2> m;
+    m.SetErrorPolicy(mm::ErrorPolicy::kErrorCode);
+    m.Add<B, B>(add_static<B, B>);
+    mm::DispatchSite<mm::MultiMethod<2>> site{};
+    V v;
+    C c;
+    D d;
+    const B &db = d;
+    const V &dv = d;
+    auto call = [&](const V &x, const V &y, bool use_site) {
+      std::array<void*, 2> ptr;
+      auto fp = use_site ? site.Find(m, ptr, x, y) : m.Find(ptr, x, y);
+      if (!fp) return -1;
+      return reinterpret_cast<int(*)(void*, void*)>(fp)(ptr[0], ptr[1]);
+    };
+    for (int s = 0; s < 2; ++s) {
+      assert(call(d, d, s) == db.value * 2);
+      assert(call(c, c, s) == -1);
+    }
+    auto dd = m.resolved_.Find({&typeid(D), &typeid(D)});
+    m.Add<V, V>(add_static<V, V>);
+    // (D, D) still gets (B, B), its entry is kept as is.
+    auto kept = m.resolved_.Find({&typeid(D), &typeid(D)});
+    assert(kept.func == dd.func && kept.offsets == dd.offsets);
+    for (int s = 0; s < 2; ++s) {
+      assert(call(c, c, s) == ((const V&)c).value * 2);
+      assert(call(v, v, s) == v.value * 2);
+    }
+    m.Add<D, D>(add_static<D, D>);
+    for (int s = 0; s < 2; ++s) {
+      assert(call(d, d, s) == d.value * 2);
+    }
+
+    // Readers see the old or the new overload, nothing else.
+    std::atomic<bool> done(false);
+    std::thread reader([&]() {
+        while (!done.load()) {
+          std::array<void*, 2> ptr;
+          auto fp = m.Find(ptr, d, c);
+          auto r = reinterpret_cast<int(*)(void*, void*)>(fp)(ptr[0], ptr[1]);
+          assert(r == dv.value + ((const V&)c).value ||
+                 r == d.value + ((const V&)c).value);
+        }
+      });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    m.Add<D, V>(add_static<D, V>);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    done = true;
+    reader.join();
+    std::array<void*, 2> ptr;
+    auto fp = m.Find(ptr, d, c);
+    assert(reinterpret_cast<int(*)(void*, void*)>(fp)(ptr[0], ptr[1]) ==
+           d.value + ((const V&)c).value);
+  }
+
+  {
+    // N = 1 goes through single_, which a late Add clears.
+    mm::MultiMethod<1> m;
+    m.Add<V>(show_static<V>);
+    D d;
+    C c;
+    auto find = [&](const V &v) {
+      std::array<void*, 1> ptr;
+      auto fp = m.Find(ptr, v);
+      return std::make_pair(fp, ptr[0]);
+    };
+    for (int i = 0; i < 2; ++i) {
+      auto r = find(d);
+      assert(r.first == (mm::void_func)show_static<V> &&
+             r.second == (const V*)&d);
+      assert(find(c).second == (const V*)&c);
+    }
+    assert(m.single_.state_.load()->size == 2);
+    m.Add<B>(show_static<B>);
+    assert(m.single_.state_.load()->size == 0);
+    auto r = find(d);
+    assert(r.first == (mm::void_func)show_static<B> &&
+           r.second == (const B*)&d);
+    assert(find(c).first == (mm::void_func)show_static<V>);
+  }
+
+  {
+    // Snapshot of mm_add, loaded in a copy, and in one with another overload.
+    auto add_overloads = [](mm::MultiMethod<2> &m) {
+      mm_add.table_.foreach([&](const mm::TypePartialArray<2> &p,
+                                const mm::void_func &f) {
+          m.Add(p, f);
+        });
+    };
+    const char *path = "multi_method_test.snapshot";
+    assert(mm::ExportSnapshot(mm_add, path, "test"));
+    mm::MultiMethod<2> copy;
+    add_overloads(copy);
+    auto r = mm::ImportSnapshot(copy, path, "test");
+    assert(r.ok && r.loaded == mm_add.resolved_.size() && r.skipped == 0);
+    assert(copy.resolved_.size() == mm_add.resolved_.size());
+    mm_add.resolved_.foreach([&](const mm::TypePartialArray<2> &real,
+                                 const decltype(mm_add)::ResolvedMethod &m) {
+        auto c = copy.resolved_.Find(real);
+        assert(c.func == m.func && c.offsets == m.offsets);
+      });
+    B b;
+    D d;
+    assert(add(d, b) == d.value + b.value);
+
+    mm::MultiMethod<2> more;
+    more.Add<F, V>(add_static<F, V>);
+    add_overloads(more);
+    r = mm::ImportSnapshot(more, path, "test");
+    assert(r.ok && r.loaded == mm_add.resolved_.size() && r.skipped == 0);
+
+    // Resolved to an overload which is gone, or which a new overload applies
+    // to.
+    size_t vv = 0, bv = 0;
+    mm::TypePartialArray<2> vv_pos{&typeid(V), &typeid(V)};
+    mm::TypePartialArray<2> bv_pos{&typeid(B), &typeid(V)};
+    mm_add.resolved_.foreach([&](const mm::TypePartialArray<2> &real,
+                                 const decltype(mm_add)::ResolvedMethod &m) {
+        vv += mm_add.Best(real, {}).pos == vv_pos;
+        bv += real >= bv_pos;
+      });
+    mm::MultiMethod<2> fewer;
+    fewer.Add<V, V>(add_static<V, V>);
+    r = mm::ImportSnapshot(fewer, path, "test");
+    assert(r.ok && r.loaded == vv && r.skipped == mm_add.resolved_.size() - vv);
+    mm::MultiMethod<2> newer;
+    add_overloads(newer);
+    newer.Add<B, V>(add_static<B, V>);
+    r = mm::ImportSnapshot(newer, path, "test");
+    assert(r.ok && r.skipped == bv && bv > 0);
+
+    r = mm::ImportSnapshot(copy, path, "other build");
+    assert(!r.ok && r.loaded == 0);
+    remove(path);
+    r = mm::ImportSnapshot(copy, path, "test");
+    assert(!r.ok);
+  }
+
   mm_bench.Add({&typeid(V)}, bench_static<V>);
   mm_bench.Add({&typeid(B)}, bench_static<B>);
 
@@ -186,6 +985,14 @@ int main(int argc, char* argv[]) {
               });
   }
 
+  {
+    D v;
+    test_func("bench D site",
+              [&](int i) {
+                bench_site(v);
+              });
+  }
+
   {
     D d;
     B b;
@@ -194,4 +1001,22 @@ int main(int argc, char* argv[]) {
                 return add(d, b);
               });
   }
+
+  {
+    D d;
+    B b;
+    test_func("add D + B site",
+              [&](int i) {
+                return add_site(d, b);
+              });
+  }
+
+  {
+    D d;
+    B b;
+    test_func("typed add D + B",
+              [&](int i) {
+                return typed_add(d, &b, i);
+              });
+  }
 }